@@ -0,0 +1,70 @@
+//
+// Created by eugene on 15/03/2021.
+//
+
+#include "AllocationCounter.hpp"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+std::atomic<size_t> allocation_count{0};
+}
+
+bool AllocationCounter::IsEnabled() {
+#ifdef ATPID_ALLOCATION_COUNTER
+  return true;
+#else
+  return false;
+#endif
+}
+
+size_t AllocationCounter::GetCount() {
+  return allocation_count.load(std::memory_order_relaxed);
+}
+
+#ifdef ATPID_ALLOCATION_COUNTER
+
+namespace {
+
+void *CountedAlloc(std::size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (void *ptr = std::malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+void *CountedAlignedAlloc(std::size_t size, std::align_val_t alignment) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  auto align = static_cast<std::size_t>(alignment);
+  /* aligned_alloc requires size to be multiple of alignment */
+  auto aligned_size = ((size ? size : 1) + align - 1) / align * align;
+  if (void *ptr = std::aligned_alloc(align, aligned_size))
+    return ptr;
+  throw std::bad_alloc();
+}
+
+}
+
+void *operator new(std::size_t size) { return CountedAlloc(size); }
+void *operator new[](std::size_t size) { return CountedAlloc(size); }
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  try { return CountedAlloc(size); } catch (...) { return nullptr; }
+}
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  try { return CountedAlloc(size); } catch (...) { return nullptr; }
+}
+void *operator new(std::size_t size, std::align_val_t alignment) { return CountedAlignedAlloc(size, alignment); }
+void *operator new[](std::size_t size, std::align_val_t alignment) { return CountedAlignedAlloc(size, alignment); }
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+
+#endif // ATPID_ALLOCATION_COUNTER
@@ -0,0 +1,74 @@
+//
+// Created by eugene on 15/03/2021.
+//
+
+#ifndef ATPIDTASK_COMMONS_ALLOCATIONCOUNTER_HPP_
+#define ATPIDTASK_COMMONS_ALLOCATIONCOUNTER_HPP_
+
+#include <cstddef>
+#include <ostream>
+#include <string>
+
+/**
+ * @brief Counter of the heap allocations made through the global operator new.
+ *
+ * The counting replacement of operator new is compiled in only
+ * with -DATPID_ALLOCATION_COUNTER=ON, otherwise the counter stays at zero.
+ */
+namespace AllocationCounter {
+
+bool IsEnabled();
+size_t GetCount();
+
+}
+
+/**
+ * @brief Allocations per event, the first warmup_events events are not accounted
+ */
+class AllocationStats {
+ public:
+  explicit AllocationStats(size_t warmup_events = 10) : warmup_events_(warmup_events) {}
+
+  void BeginEvent() {
+    count_at_begin_ = AllocationCounter::GetCount();
+  }
+
+  void EndEvent() {
+    auto n_allocations = AllocationCounter::GetCount() - count_at_begin_;
+    ++n_events_;
+    if (n_events_ <= warmup_events_)
+      return;
+    ++n_steady_events_;
+    total_allocations_ += n_allocations;
+    if (n_allocations > max_allocations_)
+      max_allocations_ = n_allocations;
+    if (n_allocations > 0)
+      ++n_allocating_events_;
+  }
+
+  void Report(std::ostream &os, const std::string &task_name) const {
+    if (!AllocationCounter::IsEnabled()) {
+      os << task_name << ": allocation counter is not compiled in (-DATPID_ALLOCATION_COUNTER=ON)" << std::endl;
+      return;
+    }
+    os << task_name << ": " << n_steady_events_ << " events after warm-up of " << warmup_events_ << " events" << std::endl;
+    if (n_steady_events_ == 0)
+      return;
+    os << task_name << ": allocations per event: mean "
+       << double(total_allocations_) / double(n_steady_events_)
+       << ", max " << max_allocations_
+       << ", events with allocations " << n_allocating_events_ << std::endl;
+  }
+
+ private:
+  size_t warmup_events_{10};
+  size_t count_at_begin_{0};
+
+  size_t n_events_{0};
+  size_t n_steady_events_{0};
+  size_t n_allocating_events_{0};
+  size_t total_allocations_{0};
+  size_t max_allocations_{0};
+};
+
+#endif //ATPIDTASK_COMMONS_ALLOCATIONCOUNTER_HPP_
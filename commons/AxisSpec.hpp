@@ -0,0 +1,56 @@
+//
+// Created by eugene on 15/03/2021.
+//
+
+#ifndef ATPIDTASK_COMMONS_AXISSPEC_HPP_
+#define ATPIDTASK_COMMONS_AXISSPEC_HPP_
+
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Uniform binning given on the command line as <nbins>:<lo>:<hi>
+ */
+struct AxisSpec {
+  int n_bins{0};
+  double lo{0.};
+  double hi{0.};
+
+  static AxisSpec Parse(const std::string &definition) {
+    auto first_colon = definition.find(':');
+    auto second_colon = first_colon == std::string::npos ?
+                        std::string::npos : definition.find(':', first_colon + 1);
+    if (second_colon == std::string::npos)
+      throw std::runtime_error("Bad axis definition '" + definition + "', expected <nbins>:<lo>:<hi>");
+
+    AxisSpec axis;
+    try {
+      axis.n_bins = std::stoi(definition.substr(0, first_colon));
+      axis.lo = std::stod(definition.substr(first_colon + 1, second_colon - first_colon - 1));
+      axis.hi = std::stod(definition.substr(second_colon + 1));
+    } catch (std::logic_error &) {
+      throw std::runtime_error("Bad axis definition '" + definition + "', expected <nbins>:<lo>:<hi>");
+    }
+    if (axis.n_bins <= 0 || !(axis.hi > axis.lo))
+      throw std::runtime_error("Bad axis definition '" + definition + "', expected nbins > 0 and hi > lo");
+    return axis;
+  }
+
+  /* n_bins + 1 bin edges */
+  std::vector<double> Edges() const {
+    std::vector<double> result(n_bins + 1);
+    const auto step = (hi - lo) / n_bins;
+    for (int i = 0; i < n_bins; ++i) {
+      result[i] = lo + i * step;
+    }
+    result[n_bins] = hi;
+    return result;
+  }
+
+  /* number of cells of the histogram along this axis including under- and overflow */
+  size_t NCells() const { return size_t(n_bins) + 2; }
+};
+
+#endif //ATPIDTASK_COMMONS_AXISSPEC_HPP_
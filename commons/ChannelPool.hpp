@@ -0,0 +1,92 @@
+//
+// Created by eugene on 15/03/2021.
+//
+
+#ifndef ATPIDTASK_COMMONS_CHANNELPOOL_HPP_
+#define ATPIDTASK_COMMONS_CHANNELPOOL_HPP_
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+#include <AnalysisTree/Detector.hpp>
+#include <AnalysisTree/BranchConfig.hpp>
+
+/**
+ * @brief Replacement of ClearChannels() + AddChannel() + Init() which keeps
+ * field storage of the channels between events.
+ *
+ * Channels unused in the current event are moved to the spare list in the
+ * reverse order, so the spare channel taken next always has the id matching
+ * its new position in the detector.
+ */
+template<typename T>
+class ChannelPool {
+ public:
+  explicit ChannelPool(AnalysisTree::Detector<T> *detector = nullptr) : detector_(detector) {}
+
+  void SetDetector(AnalysisTree::Detector<T> *detector) {
+    detector_ = detector;
+    n_used_ = 0;
+    spare_.clear();
+  }
+
+  /* beginning of the event, all channels are free */
+  void Reset() {
+    n_used_ = 0;
+  }
+
+  /* fields of a reused channel are zeroed as after Init(), the storage is kept */
+  T *Acquire(const AnalysisTree::BranchConfig &config) {
+    assert(detector_);
+    auto &channels = *detector_->GetChannels();
+    if (n_used_ < channels.size()) {
+      auto channel = &channels[n_used_++];
+      ResetFields(channel, config);
+      return channel;
+    }
+    if (!spare_.empty()) {
+      channels.emplace_back(std::move(spare_.back()));
+      spare_.pop_back();
+      ++n_used_;
+      ResetFields(&channels.back(), config);
+      return &channels.back();
+    }
+    auto channel = detector_->AddChannel();
+    channel->Init(config);
+    ++n_used_;
+    return channel;
+  }
+
+  /* end of the event, unused channels are removed from the detector */
+  void Commit() {
+    assert(detector_);
+    auto &channels = *detector_->GetChannels();
+    for (size_t i_channel = channels.size(); i_channel > n_used_; --i_channel) {
+      spare_.emplace_back(std::move(channels[i_channel - 1]));
+    }
+    channels.erase(channels.begin() + n_used_, channels.end());
+  }
+
+ private:
+  static void ResetFields(T *channel, const AnalysisTree::BranchConfig &config) {
+    for (auto &&[name, element] : config.GetMap<float>()) {
+      if (element.GetId() >= 0)
+        channel->SetField(0.f, element.GetId());
+    }
+    for (auto &&[name, element] : config.GetMap<int>()) {
+      if (element.GetId() >= 0)
+        channel->SetField(0, element.GetId());
+    }
+    for (auto &&[name, element] : config.GetMap<bool>()) {
+      if (element.GetId() >= 0)
+        channel->SetField(false, element.GetId());
+    }
+  }
+
+  AnalysisTree::Detector<T> *detector_{nullptr};
+  size_t n_used_{0};
+  std::vector<T> spare_;
+};
+
+#endif //ATPIDTASK_COMMONS_CHANNELPOOL_HPP_
@@ -0,0 +1,88 @@
+//
+// Created by eugene on 23/04/2021.
+//
+
+#include "ChunkPool.hpp"
+
+#include <algorithm>
+
+ChunkPool::ChunkPool(unsigned int n_threads) {
+  if (n_threads == 0)
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned int i_thread = 1; i_thread < n_threads; ++i_thread) {
+    workers_.emplace_back(&ChunkPool::WorkerLoop, this);
+  }
+}
+
+ChunkPool::~ChunkPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  start_cv_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+void ChunkPool::ParallelFor(size_t n, size_t chunk_size, const std::function<void(size_t, size_t)> &body) {
+  chunk_size = std::max<size_t>(chunk_size, 1);
+  if (workers_.empty() || n <= chunk_size) {
+    if (n > 0)
+      body(0, n);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    body_ = &body;
+    n_ = n;
+    chunk_size_ = chunk_size;
+    next_chunk_ = 0;
+    n_running_ = workers_.size();
+    error_ = nullptr;
+    ++generation_;
+  }
+  start_cv_.notify_all();
+
+  RunChunks();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  done_cv_.wait(lock, [this]() { return n_running_ == 0; });
+  body_ = nullptr;
+  if (error_)
+    std::rethrow_exception(error_);
+}
+
+void ChunkPool::WorkerLoop() {
+  uint64_t last_generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      start_cv_.wait(lock, [&]() { return stop_ || generation_ != last_generation; });
+      if (stop_)
+        return;
+      last_generation = generation_;
+    }
+    RunChunks();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      --n_running_;
+    }
+    done_cv_.notify_one();
+  }
+}
+
+void ChunkPool::RunChunks() {
+  const size_t n_chunks = (n_ + chunk_size_ - 1) / chunk_size_;
+  for (size_t i_chunk = next_chunk_++; i_chunk < n_chunks; i_chunk = next_chunk_++) {
+    const size_t begin = i_chunk * chunk_size_;
+    try {
+      (*body_)(begin, std::min(begin + chunk_size_, n_));
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!error_)
+        error_ = std::current_exception();
+    }
+  }
+}
@@ -0,0 +1,59 @@
+//
+// Created by eugene on 23/04/2021.
+//
+
+#ifndef ATPIDTASK_COMMONS_CHUNKPOOL_HPP_
+#define ATPIDTASK_COMMONS_CHUNKPOOL_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Persistent threads running a loop split into chunks.
+ *
+ * ParallelFor splits [0, n) into chunks of chunk_size. The workers and the
+ * calling thread take the next chunk from a shared counter until the range
+ * is exhausted, so expensive chunks are balanced dynamically. The threads
+ * are started once and sleep between the calls. Calls are not reentrant.
+ */
+class ChunkPool {
+ public:
+  /* n_threads includes the calling thread, 0 - number of cores */
+  explicit ChunkPool(unsigned int n_threads);
+  ~ChunkPool();
+  ChunkPool(const ChunkPool &) = delete;
+  ChunkPool &operator=(const ChunkPool &) = delete;
+
+  unsigned int GetNThreads() const { return unsigned(workers_.size()) + 1; }
+
+  /* body(begin, end) is called for every chunk, the first exception is rethrown */
+  void ParallelFor(size_t n, size_t chunk_size, const std::function<void(size_t, size_t)> &body);
+
+ private:
+  void WorkerLoop();
+  void RunChunks();
+
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+  uint64_t generation_{0};
+  bool stop_{false};
+  size_t n_running_{0};
+  std::exception_ptr error_;
+
+  const std::function<void(size_t, size_t)> *body_{nullptr};
+  size_t n_{0};
+  size_t chunk_size_{1};
+  std::atomic<size_t> next_chunk_{0};
+};
+
+#endif //ATPIDTASK_COMMONS_CHUNKPOOL_HPP_
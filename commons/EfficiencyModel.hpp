@@ -0,0 +1,167 @@
+//
+// Created by eugene on 12/04/2021.
+//
+
+#ifndef ATPIDTASK_COMMONS_EFFICIENCYMODEL_HPP_
+#define ATPIDTASK_COMMONS_EFFICIENCYMODEL_HPP_
+
+#include <TVectorD.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+/**
+ * @brief Smooth efficiency as a 2D polynomial in (y_cm, pT).
+ *
+ * Variables are mapped to [-1, 1] within the fit range, outside of it the
+ * model is not defined and evaluates to 0. The fit range may be divided into
+ * n_mask_y x n_mask_pt uniform cells with a bit per cell, the model evaluates
+ * to 0 in the cells not used in the fit as well. The result is clamped to [0, 1].
+ * Stored as TVectorD: degree_y, degree_pt, y_lo, y_hi, pt_lo, pt_hi,
+ * coefficients c[i_y * (degree_pt + 1) + i_pt], optionally followed by
+ * n_mask_y, n_mask_pt and the mask packed by 32 bits into each element.
+ */
+class EfficiencyModel {
+ public:
+  EfficiencyModel() = default;
+  EfficiencyModel(int degree_y, int degree_pt, double y_lo, double y_hi, double pt_lo, double pt_hi) :
+      degree_y_(degree_y), degree_pt_(degree_pt),
+      y_lo_(y_lo), y_hi_(y_hi), pt_lo_(pt_lo), pt_hi_(pt_hi),
+      coefficients_(size_t((degree_y + 1) * (degree_pt + 1)), 0.) {}
+
+  static EfficiencyModel FromVector(const TVectorD &v) {
+    if (v.GetNrows() < 6)
+      throw std::runtime_error("Bad efficiency model: too short");
+    EfficiencyModel model(static_cast<int>(v[0]), static_cast<int>(v[1]), v[2], v[3], v[4], v[5]);
+    const size_t n_rows = v.GetNrows();
+    const size_t n_head = 6 + model.coefficients_.size();
+    if (n_rows != n_head && n_rows < n_head + 2)
+      throw std::runtime_error("Bad efficiency model: wrong number of coefficients");
+    for (size_t i = 0; i < model.coefficients_.size(); ++i) {
+      model.coefficients_[i] = v[int(6 + i)];
+    }
+    if (n_rows > n_head) {
+      model.InitMask(static_cast<int>(v[int(n_head)]), static_cast<int>(v[int(n_head + 1)]));
+      if (n_rows != n_head + 2 + model.mask_.size())
+        throw std::runtime_error("Bad efficiency model: wrong size of the mask");
+      for (size_t i = 0; i < model.mask_.size(); ++i) {
+        model.mask_[i] = static_cast<uint32_t>(v[int(n_head + 2 + i)]);
+      }
+    }
+    return model;
+  }
+
+  TVectorD ToVector() const {
+    const size_t n_head = 6 + coefficients_.size();
+    TVectorD v(int(n_head + (mask_.empty() ? 0 : 2 + mask_.size())));
+    v[0] = degree_y_;
+    v[1] = degree_pt_;
+    v[2] = y_lo_;
+    v[3] = y_hi_;
+    v[4] = pt_lo_;
+    v[5] = pt_hi_;
+    for (size_t i = 0; i < coefficients_.size(); ++i) {
+      v[int(6 + i)] = coefficients_[i];
+    }
+    if (!mask_.empty()) {
+      v[int(n_head)] = n_mask_y_;
+      v[int(n_head + 1)] = n_mask_pt_;
+      for (size_t i = 0; i < mask_.size(); ++i) {
+        v[int(n_head + 2 + i)] = mask_[i];
+      }
+    }
+    return v;
+  }
+
+  /* divides the fit range into cells, none of them fitted */
+  void InitMask(int n_mask_y, int n_mask_pt) {
+    if (n_mask_y <= 0 || n_mask_pt <= 0)
+      throw std::runtime_error("Bad efficiency model: empty mask");
+    n_mask_y_ = n_mask_y;
+    n_mask_pt_ = n_mask_pt;
+    mask_.assign((size_t(n_mask_y) * size_t(n_mask_pt) + 31) / 32, 0u);
+  }
+  void SetFitted(double y, double pt) {
+    const auto cell = MaskCell(ScaleY(y), ScalePt(pt));
+    mask_[cell / 32] |= 1u << (cell % 32);
+  }
+  bool HasMask() const { return !mask_.empty(); }
+
+  int GetDegreeY() const { return degree_y_; }
+  int GetDegreePt() const { return degree_pt_; }
+  size_t GetNCoefficients() const { return coefficients_.size(); }
+  std::vector<double> &Coefficients() { return coefficients_; }
+
+  double ScaleY(double y) const { return (2. * y - y_lo_ - y_hi_) / (y_hi_ - y_lo_); }
+  double ScalePt(double pt) const { return (2. * pt - pt_lo_ - pt_hi_) / (pt_hi_ - pt_lo_); }
+
+  /* basis functions u^i_y * v^i_pt in the order of the coefficients */
+  void Basis(double y, double pt, double *basis) const {
+    const double u = ScaleY(y);
+    const double v = ScalePt(pt);
+    double u_pow = 1.;
+    for (int i_y = 0; i_y <= degree_y_; ++i_y) {
+      double v_pow = 1.;
+      for (int i_pt = 0; i_pt <= degree_pt_; ++i_pt) {
+        basis[i_y * (degree_pt_ + 1) + i_pt] = u_pow * v_pow;
+        v_pow *= v;
+      }
+      u_pow *= u;
+    }
+  }
+
+  float Eval(float y, float pt) const {
+    float result;
+    Eval(&y, &pt, &result, 1);
+    return result;
+  }
+
+  /* efficiencies of n particles, Horner scheme in both variables */
+  void Eval(const float *y, const float *pt, float *efficiency, size_t n) const {
+    const double *c = coefficients_.data();
+    const int n_pt = degree_pt_ + 1;
+    for (size_t i = 0; i < n; ++i) {
+      const double u = ScaleY(y[i]);
+      const double v = ScalePt(pt[i]);
+      double result = 0.;
+      for (int i_y = degree_y_; i_y >= 0; --i_y) {
+        double row = 0.;
+        for (int i_pt = degree_pt_; i_pt >= 0; --i_pt) {
+          row = row * v + c[i_y * n_pt + i_pt];
+        }
+        result = result * u + row;
+      }
+      bool in_range = u >= -1. && u <= 1. && v >= -1. && v <= 1.;
+      if (in_range && !mask_.empty()) {
+        const auto cell = MaskCell(u, v);
+        in_range = (mask_[cell / 32] >> (cell % 32)) & 1u;
+      }
+      result = result < 0. ? 0. : (result > 1. ? 1. : result);
+      efficiency[i] = in_range ? float(result) : 0.f;
+    }
+  }
+
+ private:
+  /* cell of the mask at the scaled variables within [-1, 1], the upper edge belongs to the last cell */
+  size_t MaskCell(double u, double v) const {
+    const int i_y = std::min(static_cast<int>((u + 1.) * 0.5 * n_mask_y_), n_mask_y_ - 1);
+    const int i_pt = std::min(static_cast<int>((v + 1.) * 0.5 * n_mask_pt_), n_mask_pt_ - 1);
+    return size_t(i_y) * size_t(n_mask_pt_) + size_t(i_pt);
+  }
+
+  int degree_y_{0};
+  int degree_pt_{0};
+  double y_lo_{0.};
+  double y_hi_{1.};
+  double pt_lo_{0.};
+  double pt_hi_{1.};
+  std::vector<double> coefficients_;
+  int n_mask_y_{0};
+  int n_mask_pt_{0};
+  std::vector<uint32_t> mask_;
+};
+
+#endif //ATPIDTASK_COMMONS_EFFICIENCYMODEL_HPP_
@@ -0,0 +1,96 @@
+//
+// Created by eugene on 22/03/2021.
+//
+
+#include "EventSampler.hpp"
+
+#include <TList.h>
+#include <TParameter.h>
+#include <TTree.h>
+
+#include <AnalysisTree/Configuration.hpp>
+#include <AnalysisTree/Constants.hpp>
+#include <AnalysisTree/EventHeader.hpp>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+/* splitmix64 finalizer */
+uint64_t HashId(uint64_t value) {
+  value += 0x9e3779b97f4a7c15ULL;
+  value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+  return value ^ (value >> 31);
+}
+
+}
+
+void EventSampler::Configure(unsigned int every, uint64_t seed) {
+  every_ = std::max(every, 1u);
+  seed_ = seed;
+}
+
+unsigned int EventSampler::EveryForTarget(Long64_t n_entries, Long64_t n_target) {
+  if (n_target <= 0 || n_entries <= n_target)
+    return 1;
+  return static_cast<unsigned int>(n_entries / n_target);
+}
+
+void EventSampler::InitEventId(std::map<std::string, void *> &map,
+                               const AnalysisTree::Configuration &config,
+                               const std::string &event_id) {
+  const auto dot_pos = event_id.find('.');
+  if (dot_pos == std::string::npos)
+    throw std::runtime_error("EventSampler: event id '" + event_id + "' is not '<branch>.<field>'");
+  event_id_branch_ = event_id.substr(0, dot_pos);
+  const auto field_name = event_id.substr(dot_pos + 1);
+
+  auto header_it = map.find(event_id_branch_);
+  if (header_it == map.end() || !header_it->second)
+    throw std::runtime_error("EventSampler: branch '" + event_id_branch_ + "' is not found in the input");
+  event_header_ = static_cast<const AnalysisTree::EventHeader *>(header_it->second);
+
+  const auto &branch_config = config.GetBranchConfig(event_id_branch_);
+  event_id_field_id_ = branch_config.GetFieldId(field_name);
+  const auto &int_fields = branch_config.GetMap<int>();
+  if (event_id_field_id_ == AnalysisTree::UndefValueShort || int_fields.find(field_name) == int_fields.end())
+    throw std::runtime_error("EventSampler: '" + event_id + "' is not an integer field");
+}
+
+bool EventSampler::Selects(Long64_t event_id) const {
+  if (every_ <= 1)
+    return true;
+  return HashId(uint64_t(event_id) ^ seed_) % every_ == 0;
+}
+
+bool EventSampler::Process() {
+  if (!IsEnabled()) {
+    is_selected_ = true;
+    return true;
+  }
+  if (!event_header_)
+    throw std::runtime_error("EventSampler: event id is not initialized");
+  is_selected_ = Selects(event_header_->GetField<int>(event_id_field_id_));
+  ++n_seen_;
+  if (is_selected_)
+    ++n_selected_;
+  return is_selected_;
+}
+
+void EventSampler::AddFlagBranch(TTree *out_tree, const std::string &name) {
+  out_tree->Branch(name.c_str(), &is_selected_, (name + "/O").c_str());
+}
+
+void EventSampler::Record(TList *list, const std::string &prefix) const {
+  if (!list)
+    return;
+  list->Add(new TParameter<Int_t>((prefix + "_sampling_every").c_str(), Int_t(every_)));
+  list->Add(new TParameter<Double_t>((prefix + "_sampling_fraction").c_str(), GetFraction()));
+}
+
+void EventSampler::Print(std::ostream &os, const std::string &prefix) const {
+  os << prefix << ": event sampling 1 in " << every_ << ", selected " << n_selected_ << "/" << n_seen_
+     << " events (fraction " << GetFraction() << ")" << std::endl;
+}
@@ -0,0 +1,82 @@
+//
+// Created by eugene on 22/03/2021.
+//
+
+#ifndef ATPIDTASK_COMMONS_EVENTSAMPLER_HPP_
+#define ATPIDTASK_COMMONS_EVENTSAMPLER_HPP_
+
+#include <Rtypes.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+
+class TList;
+class TTree;
+namespace AnalysisTree {
+class Configuration;
+class EventHeader;
+}
+
+/**
+ * @brief Deterministic selection of 1 in N events for quick-look runs.
+ *
+ * An event is selected if the hash of its id (an integer field of the event
+ * header) and the seed is divisible by N. The selection does not depend on
+ * the file list or on the split of the input into jobs, and tasks configured
+ * with the same N and seed select the same events. Every task owns its
+ * sampler. Unselected events are written with empty output of the task and
+ * flagged by the bool branch added with AddFlagBranch().
+ */
+class EventSampler {
+ public:
+  /* every = 1 disables sampling */
+  void Configure(unsigned int every, uint64_t seed = 0);
+  /* 'every' giving approximately n_target of n_entries events */
+  static unsigned int EveryForTarget(Long64_t n_entries, Long64_t n_target);
+
+  /* event_id is '<event header branch>.<integer field>', throws if it is not available */
+  void InitEventId(std::map<std::string, void *> &map,
+                   const AnalysisTree::Configuration &config,
+                   const std::string &event_id);
+  const std::string &GetEventIdBranch() const { return event_id_branch_; }
+
+  bool IsEnabled() const { return every_ > 1; }
+  bool Selects(Long64_t event_id) const;
+
+  /**
+   * @brief To be called once per event at the beginning of UserExec.
+   * @return true if the current event is selected
+   */
+  bool Process();
+
+  /* bool branch '<name>' of the output tree, false for the events not processed by the task */
+  void AddFlagBranch(TTree *out_tree, const std::string &name);
+
+  unsigned int GetEvery() const { return every_; }
+  uint64_t GetSeed() const { return seed_; }
+  /* fraction of the processed events which were selected */
+  double GetFraction() const {
+    return n_seen_ > 0 ? double(n_selected_) / double(n_seen_) : 1. / every_;
+  }
+
+  /* adds '<prefix>_sampling_every' and '<prefix>_sampling_fraction' parameters */
+  void Record(TList *list, const std::string &prefix) const;
+  void Print(std::ostream &os, const std::string &prefix) const;
+
+ private:
+  unsigned int every_{1};
+  uint64_t seed_{0};
+
+  std::string event_id_branch_;
+  const AnalysisTree::EventHeader *event_header_{nullptr};
+  short event_id_field_id_{-1};
+
+  Bool_t is_selected_{true};
+  size_t n_seen_{0};
+  size_t n_selected_{0};
+};
+
+#endif //ATPIDTASK_COMMONS_EVENTSAMPLER_HPP_
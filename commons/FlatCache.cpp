@@ -0,0 +1,221 @@
+//
+// Created by eugene on 22/03/2021.
+//
+
+#include "FlatCache.hpp"
+
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace FlatCache;
+
+namespace {
+
+uint64_t Align(uint64_t pos) {
+  return (pos + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+void CopyName(char (&dst)[kNameLength], const std::string &src) {
+  if (src.size() >= kNameLength)
+    throw std::runtime_error("FlatCache: name '" + src + "' is too long");
+  std::memset(dst, 0, kNameLength);
+  std::memcpy(dst, src.data(), src.size());
+}
+
+void WriteAt(std::FILE *file, uint64_t pos, const void *data, size_t size) {
+  if (std::fseek(file, long(pos), SEEK_SET) != 0 || std::fwrite(data, 1, size, file) != size)
+    throw std::runtime_error("FlatCache: write error");
+}
+
+}
+
+Writer::Writer(std::string file_name) : file_name_(std::move(file_name)) {}
+
+Writer::~Writer() {
+  try {
+    Close();
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+  }
+}
+
+size_t Writer::AddBranch(const std::string &name) {
+  if (n_events_ > 0)
+    throw std::runtime_error("FlatCache: branches must be added before the first event");
+  branches_.emplace_back();
+  branches_.back().name = name;
+  return branches_.size() - 1;
+}
+
+size_t Writer::AddColumn(size_t branch, const std::string &name, ColumnType type) {
+  if (n_events_ > 0)
+    throw std::runtime_error("FlatCache: columns must be added before the first event");
+  ColumnState column;
+  column.name = name;
+  column.branch = branch;
+  column.type = type;
+  column.tmp_file = std::tmpfile();
+  if (!column.tmp_file)
+    throw std::runtime_error("FlatCache: unable to create temporary file");
+  columns_.emplace_back(column);
+  return columns_.size() - 1;
+}
+
+void Writer::Append(size_t column_id, ColumnType type, const void *value) {
+  auto &column = columns_.at(column_id);
+  if (column.type != type)
+    throw std::runtime_error("FlatCache: column '" + column.name + "' has different type");
+  if (std::fwrite(value, 4, 1, column.tmp_file) != 1)
+    throw std::runtime_error("FlatCache: unable to write column '" + column.name + "' to the temporary file");
+  ++column.n_values;
+}
+
+void Writer::EndEvent() {
+  for (auto &branch : branches_) {
+    branch.offsets.push_back(branch.n_entries);
+  }
+  for (auto &column : columns_) {
+    if (column.n_values != branches_[column.branch].n_entries)
+      throw std::runtime_error("FlatCache: column '" + column.name + "' is not filled for every entry");
+  }
+  ++n_events_;
+}
+
+void Writer::Close() {
+  if (closed_)
+    return;
+  closed_ = true;
+
+  auto tmp_name = file_name_ + ".tmp";
+  std::FILE *file = std::fopen(tmp_name.c_str(), "wb");
+  if (!file)
+    throw std::runtime_error("FlatCache: unable to open '" + tmp_name + "'");
+
+  FileHeader header{};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.n_branches = uint32_t(branches_.size());
+  header.n_columns = uint32_t(columns_.size());
+  header.n_events = n_events_;
+
+  uint64_t pos = sizeof(FileHeader) + branches_.size() * sizeof(BranchRecord) + columns_.size() * sizeof(ColumnRecord);
+
+  std::vector<BranchRecord> branch_records(branches_.size());
+  for (size_t i_branch = 0; i_branch < branches_.size(); ++i_branch) {
+    pos = Align(pos);
+    CopyName(branch_records[i_branch].name, branches_[i_branch].name);
+    branch_records[i_branch].offsets_pos = pos;
+    WriteAt(file, pos, branches_[i_branch].offsets.data(), branches_[i_branch].offsets.size() * sizeof(uint64_t));
+    pos += branches_[i_branch].offsets.size() * sizeof(uint64_t);
+  }
+
+  std::vector<ColumnRecord> column_records(columns_.size());
+  std::vector<char> buffer(1 << 20);
+  for (size_t i_column = 0; i_column < columns_.size(); ++i_column) {
+    auto &column = columns_[i_column];
+    pos = Align(pos);
+    CopyName(column_records[i_column].name, column.name);
+    column_records[i_column].branch = uint32_t(column.branch);
+    column_records[i_column].type = uint32_t(column.type);
+    column_records[i_column].data_pos = pos;
+    column_records[i_column].n_values = column.n_values;
+
+    std::rewind(column.tmp_file);
+    std::fseek(file, long(pos), SEEK_SET);
+    size_t n_read;
+    while ((n_read = std::fread(buffer.data(), 1, buffer.size(), column.tmp_file)) > 0) {
+      if (std::fwrite(buffer.data(), 1, n_read, file) != n_read)
+        throw std::runtime_error("FlatCache: write error");
+    }
+    std::fclose(column.tmp_file);
+    column.tmp_file = nullptr;
+    pos += column.n_values * 4;
+  }
+
+  WriteAt(file, 0, &header, sizeof(header));
+  WriteAt(file, sizeof(header), branch_records.data(), branch_records.size() * sizeof(BranchRecord));
+  WriteAt(file, sizeof(header) + branch_records.size() * sizeof(BranchRecord),
+          column_records.data(), column_records.size() * sizeof(ColumnRecord));
+  std::fclose(file);
+
+  if (std::rename(tmp_name.c_str(), file_name_.c_str()) != 0)
+    throw std::runtime_error("FlatCache: unable to rename '" + tmp_name + "'");
+  std::cout << "FlatCache: " << n_events_ << " events, " << columns_.size() << " columns written to '"
+            << file_name_ << "'" << std::endl;
+}
+
+Reader::Reader(const std::string &file_name) {
+  int fd = ::open(file_name.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("FlatCache: unable to open '" + file_name + "'");
+  struct stat file_stat{};
+  if (::fstat(fd, &file_stat) != 0 || size_t(file_stat.st_size) < sizeof(FileHeader)) {
+    ::close(fd);
+    throw std::runtime_error("FlatCache: '" + file_name + "' is not a flat cache");
+  }
+  size_ = size_t(file_stat.st_size);
+  void *mapped = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED)
+    throw std::runtime_error("FlatCache: unable to map '" + file_name + "'");
+  ::madvise(mapped, size_, MADV_SEQUENTIAL);
+  data_ = static_cast<const char *>(mapped);
+
+  header_ = reinterpret_cast<const FileHeader *>(data_);
+  if (std::memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0 || header_->version != kVersion) {
+    ::munmap(mapped, size_);
+    throw std::runtime_error("FlatCache: '" + file_name + "' has unknown format");
+  }
+  const uint64_t records_size = sizeof(FileHeader) +
+      uint64_t(header_->n_branches) * sizeof(BranchRecord) + uint64_t(header_->n_columns) * sizeof(ColumnRecord);
+  if (records_size > size_) {
+    ::munmap(mapped, size_);
+    throw std::runtime_error("FlatCache: '" + file_name + "' is truncated");
+  }
+  branches_ = reinterpret_cast<const BranchRecord *>(data_ + sizeof(FileHeader));
+  columns_ = reinterpret_cast<const ColumnRecord *>(branches_ + header_->n_branches);
+}
+
+Reader::~Reader() {
+  if (data_)
+    ::munmap(const_cast<char *>(data_), size_);
+}
+
+int Reader::FindBranch(const std::string &name) const {
+  for (uint32_t i_branch = 0; i_branch < header_->n_branches; ++i_branch) {
+    if (name == branches_[i_branch].name)
+      return int(i_branch);
+  }
+  return -1;
+}
+
+int Reader::FindColumn(const std::string &branch, const std::string &name) const {
+  auto branch_id = FindBranch(branch);
+  if (branch_id < 0)
+    return -1;
+  for (uint32_t i_column = 0; i_column < header_->n_columns; ++i_column) {
+    if (columns_[i_column].branch == uint32_t(branch_id) && name == columns_[i_column].name)
+      return int(i_column);
+  }
+  return -1;
+}
+
+void Reader::Print() const {
+  std::cout << "FlatCache: " << header_->n_events << " events" << std::endl;
+  for (uint32_t i_branch = 0; i_branch < header_->n_branches; ++i_branch) {
+    std::cout << "  " << branches_[i_branch].name << " (" << GetOffsets(int(i_branch))[header_->n_events]
+              << " entries):";
+    for (uint32_t i_column = 0; i_column < header_->n_columns; ++i_column) {
+      if (columns_[i_column].branch == i_branch) {
+        std::cout << " " << columns_[i_column].name
+                  << (ColumnType(columns_[i_column].type) == ColumnType::kFloat ? "/F" : "/I");
+      }
+    }
+    std::cout << std::endl;
+  }
+}
@@ -0,0 +1,164 @@
+//
+// Created by eugene on 22/03/2021.
+//
+
+#ifndef ATPIDTASK_COMMONS_FLATCACHE_HPP_
+#define ATPIDTASK_COMMONS_FLATCACHE_HPP_
+
+#include <cstdint>
+#include <cstdio>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Columnar cache of the selected AnalysisTree fields.
+ *
+ * Layout of the file:
+ *   FileHeader
+ *   BranchRecord[n_branches]  each branch has its own per-event offsets
+ *   ColumnRecord[n_columns]
+ *   uint64_t offsets[n_events + 1] for every branch
+ *   values of every column (float or int32), sections are 64-byte aligned
+ *
+ * Values of the branch entries of the event i are in [offsets[i], offsets[i+1]).
+ * The file is memory-mapped by the Reader, no deserialization is needed.
+ */
+namespace FlatCache {
+
+enum class ColumnType : uint32_t {
+  kFloat = 0,
+  kInt = 1
+};
+
+constexpr char kMagic[8] = {'A', 'T', 'P', 'I', 'D', 'F', 'C', '1'};
+constexpr uint32_t kVersion = 1;
+constexpr size_t kNameLength = 64;
+constexpr uint64_t kAlignment = 64;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t n_branches;
+  uint32_t n_columns;
+  uint32_t reserved;
+  uint64_t n_events;
+};
+
+struct BranchRecord {
+  char name[kNameLength];
+  uint64_t offsets_pos;
+};
+
+struct ColumnRecord {
+  char name[kNameLength];
+  uint32_t branch;
+  uint32_t type;
+  uint64_t data_pos;
+  uint64_t n_values;
+};
+
+class Writer {
+ public:
+  explicit Writer(std::string file_name);
+  ~Writer();
+  Writer(const Writer &) = delete;
+  Writer &operator=(const Writer &) = delete;
+
+  size_t AddBranch(const std::string &name);
+  size_t AddColumn(size_t branch, const std::string &name, ColumnType type);
+
+  /* new entry (channel) of the branch in the current event */
+  void FillEntry(size_t branch) { ++branches_.at(branch).n_entries; }
+  void Fill(size_t column, float value) { Append(column, ColumnType::kFloat, &value); }
+  void Fill(size_t column, int value) {
+    auto value32 = int32_t(value);
+    Append(column, ColumnType::kInt, &value32);
+  }
+  void EndEvent();
+
+  /* writes the file, called by the destructor if omitted */
+  void Close();
+
+ private:
+  struct BranchState {
+    std::string name;
+    uint64_t n_entries{0};
+    std::vector<uint64_t> offsets{0};
+  };
+  struct ColumnState {
+    std::string name;
+    size_t branch{0};
+    ColumnType type{ColumnType::kFloat};
+    uint64_t n_values{0};
+    std::FILE *tmp_file{nullptr};
+  };
+
+  void Append(size_t column, ColumnType type, const void *value);
+
+  std::string file_name_;
+  bool closed_{false};
+  uint64_t n_events_{0};
+  std::vector<BranchState> branches_;
+  std::vector<ColumnState> columns_;
+};
+
+class Reader {
+ public:
+  explicit Reader(const std::string &file_name);
+  ~Reader();
+  Reader(const Reader &) = delete;
+  Reader &operator=(const Reader &) = delete;
+
+  uint64_t GetNEvents() const { return header_->n_events; }
+
+  /* -1 if not found */
+  int FindBranch(const std::string &name) const;
+  int FindColumn(const std::string &branch, const std::string &name) const;
+
+  const uint64_t *GetOffsets(int branch) const {
+    if (branch < 0 || uint32_t(branch) >= header_->n_branches)
+      throw std::runtime_error("FlatCache: branch " + std::to_string(branch) + " is out of range");
+    const auto offsets_pos = branches_[branch].offsets_pos;
+    if (offsets_pos > size_ || (size_ - offsets_pos) / sizeof(uint64_t) < header_->n_events + 1)
+      throw std::runtime_error("FlatCache: offsets of '" + std::string(branches_[branch].name) + "' are truncated");
+    return reinterpret_cast<const uint64_t *>(data_ + offsets_pos);
+  }
+  std::pair<uint64_t, uint64_t> GetEventRange(int branch, uint64_t event) const {
+    if (event >= header_->n_events)
+      throw std::runtime_error("FlatCache: event " + std::to_string(event) + " is out of range");
+    auto offsets = GetOffsets(branch);
+    return {offsets[event], offsets[event + 1]};
+  }
+
+  template<typename T>
+  const T *GetColumn(const std::string &branch, const std::string &name) const {
+    static_assert(sizeof(T) == 4, "Only float and int32 columns are supported");
+    auto column_id = FindColumn(branch, name);
+    if (column_id < 0)
+      throw std::runtime_error("FlatCache: column '" + branch + "." + name + "' is not found");
+    auto &column = columns_[column_id];
+    constexpr auto expected_type = std::is_floating_point<T>::value ? ColumnType::kFloat : ColumnType::kInt;
+    if (ColumnType(column.type) != expected_type)
+      throw std::runtime_error("FlatCache: column '" + branch + "." + name + "' has different type");
+    const auto n_entries = GetOffsets(int(column.branch))[header_->n_events];
+    if (column.n_values != n_entries || column.data_pos > size_ || (size_ - column.data_pos) / 4 < column.n_values)
+      throw std::runtime_error("FlatCache: column '" + branch + "." + name + "' is truncated");
+    return reinterpret_cast<const T *>(data_ + column.data_pos);
+  }
+
+  void Print() const;
+
+ private:
+  const char *data_{nullptr};
+  size_t size_{0};
+  const FileHeader *header_{nullptr};
+  const BranchRecord *branches_{nullptr};
+  const ColumnRecord *columns_{nullptr};
+};
+
+}
+
+#endif //ATPIDTASK_COMMONS_FLATCACHE_HPP_
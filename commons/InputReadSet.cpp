@@ -0,0 +1,95 @@
+//
+// Created by eugene on 18/03/2021.
+//
+
+#include "InputReadSet.hpp"
+
+#include <TTree.h>
+#include <AnalysisTree/Configuration.hpp>
+#include <AnalysisTree/Constants.hpp>
+
+#include <iostream>
+#include <stdexcept>
+
+InputReadSet &InputReadSet::Instance() {
+  static InputReadSet instance;
+  return instance;
+}
+
+void InputReadSet::Declare(const std::string &branch, const std::vector<std::string> &fields,
+                           const std::string &owner) {
+  auto &branch_fields = branches_[branch];
+  branch_fields.insert(fields.begin(), fields.end());
+  owners_[branch].insert(owner);
+}
+
+void InputReadSet::SetStatus(TTree *tree, const std::string &branch_name, bool status) {
+  const bool has_dot = !branch_name.empty() && branch_name.back() == '.';
+  UInt_t n_found = 0;
+  tree->SetBranchStatus(branch_name.c_str(), status, &n_found);
+  tree->SetBranchStatus((branch_name + (has_dot ? "*" : ".*")).c_str(), status, &n_found);
+}
+
+void InputReadSet::Apply(TTree *tree, const AnalysisTree::Configuration *config) {
+  if (applied_)
+    return;
+  if (!tree)
+    throw std::runtime_error("InputReadSet: input tree is not available");
+  applied_ = true;
+
+  if (read_all_) {
+    std::cout << "InputReadSet: a task reads all input branches, input is not pruned" << std::endl;
+    return;
+  }
+  Print(std::cout, config);
+
+  for (auto &&[branch, fields] : branches_) {
+    if (!tree->GetBranch(branch.c_str()) && !tree->GetBranch((branch + ".").c_str())) {
+      std::cout << "InputReadSet: WARNING: branch '" << branch << "' is not found in the input" << std::endl;
+    }
+  }
+  for (auto object : *tree->GetListOfBranches()) {
+    std::string branch_name = object->GetName();
+    const bool has_dot = !branch_name.empty() && branch_name.back() == '.';
+    const auto declared_name = has_dot ? branch_name.substr(0, branch_name.size() - 1) : branch_name;
+    if (IsDeclared(declared_name))
+      continue;
+    SetStatus(tree, branch_name, false);
+  }
+}
+
+void InputReadSet::Release(TTree *tree, const std::string &owner) {
+  if (!tree || read_all_)
+    return;
+  for (auto object : *tree->GetListOfBranches()) {
+    std::string branch_name = object->GetName();
+    const bool has_dot = !branch_name.empty() && branch_name.back() == '.';
+    const auto declared_name = has_dot ? branch_name.substr(0, branch_name.size() - 1) : branch_name;
+    auto owners_it = owners_.find(declared_name);
+    if (owners_it == owners_.end() || owners_it->second.erase(owner) == 0 || !owners_it->second.empty())
+      continue;
+    SetStatus(tree, branch_name, false);
+    branches_.erase(declared_name);
+    owners_.erase(owners_it);
+    std::cout << "InputReadSet: '" << declared_name << "' is not read anymore (released by " << owner << ")"
+              << std::endl;
+  }
+}
+
+void InputReadSet::Print(std::ostream &os, const AnalysisTree::Configuration *config) const {
+  os << "Planned read set (" << branches_.size() << " branches):" << std::endl;
+  for (auto &&[branch, fields] : branches_) {
+    os << "  " << branch;
+    if (fields.empty()) {
+      os << " (all fields)" << std::endl;
+      continue;
+    }
+    os << ":";
+    for (auto &field : fields) {
+      os << " " << field;
+      if (config && config->GetBranchConfig(branch).GetFieldId(field) == AnalysisTree::UndefValueShort)
+        os << " (missing!)";
+    }
+    os << std::endl;
+  }
+}
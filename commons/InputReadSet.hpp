@@ -0,0 +1,73 @@
+//
+// Created by eugene on 18/03/2021.
+//
+
+#ifndef ATPIDTASK_COMMONS_INPUTREADSET_HPP_
+#define ATPIDTASK_COMMONS_INPUTREADSET_HPP_
+
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+
+class TTree;
+namespace AnalysisTree {
+class Configuration;
+}
+
+/**
+ * @brief Branches and fields declared by the tasks of the executable.
+ *
+ * Declarations of all tasks are merged, Apply() disables all the other
+ * input branches so they are neither read nor decompressed.
+ * AnalysisTree stores all fields of the channel together, thus the
+ * pruning is done on the branch level, fields are validated and reported.
+ *
+ * Every task of the executable must declare its inputs in UserInit, a task
+ * without pruning declares all of them with DeclareAll(). Apply() is called
+ * at the beginning of UserExec of every task and takes effect once, when
+ * all the tasks are initialized. Only undeclared branches are disabled,
+ * the status of the declared ones is left as the tasks set it.
+ *
+ * A task which stops reading before the end of the input (e.g. on
+ * convergence) declares its branches with an owner and calls Release():
+ * the branches nobody else declared are disabled from then on.
+ */
+class InputReadSet {
+ public:
+  static InputReadSet &Instance();
+
+  /* owner is needed only to Release() the branch later */
+  void Declare(const std::string &branch, const std::vector<std::string> &fields = {},
+               const std::string &owner = "");
+  /* the task reads all input branches, nothing is pruned */
+  void DeclareAll() { read_all_ = true; }
+
+  bool IsDeclared(const std::string &branch) const {
+    return branches_.find(branch) != branches_.end();
+  }
+
+  const std::map<std::string, std::set<std::string>> &GetBranches() const { return branches_; }
+
+  /* disables the undeclared top-level branches of the tree, only the first call has an effect */
+  void Apply(TTree *tree, const AnalysisTree::Configuration *config = nullptr);
+
+  /* disables the branches declared by the owner only, nothing if the input is not pruned */
+  void Release(TTree *tree, const std::string &owner);
+
+  void Print(std::ostream &os, const AnalysisTree::Configuration *config = nullptr) const;
+
+ private:
+  static void SetStatus(TTree *tree, const std::string &branch_name, bool status);
+
+  InputReadSet() = default;
+
+  std::map<std::string, std::set<std::string>> branches_;
+  /* "" for the tasks not releasing their branches */
+  std::map<std::string, std::set<std::string>> owners_;
+  bool read_all_{false};
+  bool applied_{false};
+};
+
+#endif //ATPIDTASK_COMMONS_INPUTREADSET_HPP_
@@ -0,0 +1,86 @@
+//
+// Created by eugene on 12/03/2021.
+//
+
+#ifndef ATPIDTASK_COMMONS_OUTPUTPROFILE_HPP_
+#define ATPIDTASK_COMMONS_OUTPUTPROFILE_HPP_
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Rounds the float to the coarsest binary mantissa which still keeps
+ * the absolute precision. Zeroed low mantissa bits are compressed away by ROOT.
+ */
+inline float QuantizeFloat(float value, float precision) {
+  if (!(precision > 0.f) || value == 0.f || !std::isfinite(value))
+    return value;
+
+  int exponent = 0;
+  std::frexp(value, &exponent);
+  /* number of explicit mantissa bits to keep */
+  int keep_bits = exponent - 1 - std::ilogb(precision);
+  if (keep_bits >= 23)
+    return value;
+  if (keep_bits < 0)
+    return 0.f;
+
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const uint32_t drop_bits = 23 - keep_bits;
+  const uint32_t half = 1u << (drop_bits - 1);
+  bits = (bits + half) & ~((1u << drop_bits) - 1u);
+  std::memcpy(&value, &bits, sizeof(bits));
+  return value;
+}
+
+/**
+ * @brief Output schema of the RecParticles-like branches.
+ *
+ * 'full' writes every field as before, 'compact' drops fields which can be
+ * rebuilt from the others (e.g. y = y_cm + y_beam). Float fields may be
+ * quantized with the declared absolute precision in both profiles.
+ */
+struct OutputProfile {
+  bool compact{false};
+  std::map<std::string, float> precisions;
+
+  static OutputProfile Parse(const std::string &profile_name,
+                             const std::vector<std::string> &precision_definitions) {
+    OutputProfile profile;
+    if (profile_name == "compact") {
+      profile.compact = true;
+    } else if (profile_name != "full") {
+      throw std::runtime_error("Unknown output profile '" + profile_name + "', expected 'full' or 'compact'");
+    }
+
+    /* format: <field>:<precision> */
+    for (auto &definition : precision_definitions) {
+      auto colon_pos = definition.find(':');
+      if (colon_pos == std::string::npos || colon_pos == 0)
+        throw std::runtime_error("Bad precision definition '" + definition + "', expected <field>:<precision>");
+      profile.precisions[definition.substr(0, colon_pos)] = std::stof(definition.substr(colon_pos + 1));
+    }
+    return profile;
+  }
+
+  /* field is derived from the others and is not written in compact profile */
+  bool Drops(const std::string &field) const {
+    return compact && derived_fields.count(field) > 0;
+  }
+
+  float Precision(const std::string &field) const {
+    auto it = precisions.find(field);
+    return it == precisions.end() ? 0.f : it->second;
+  }
+
+  std::set<std::string> derived_fields{"y", "nhits_ratio"};
+};
+
+#endif //ATPIDTASK_COMMONS_OUTPUTPROFILE_HPP_
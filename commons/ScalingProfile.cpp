@@ -0,0 +1,193 @@
+//
+// Created by eugene on 21/04/2021.
+//
+
+#include "ScalingProfile.hpp"
+
+#include <TDecompSVD.h>
+#include <TList.h>
+#include <TMatrixD.h>
+#include <TParameter.h>
+#include <TProfile.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+
+namespace {
+
+/* 0, 1 and integer edges spaced logarithmically up to max_tracks, coinciding ones are merged */
+std::vector<double> LogEdges(size_t max_tracks, size_t n_bins) {
+  max_tracks = std::max<size_t>(max_tracks, 2);
+  n_bins = std::max<size_t>(n_bins, 2);
+  std::vector<double> edges{0.};
+  for (size_t i_edge = 0; i_edge < n_bins; ++i_edge) {
+    const double edge = std::ceil(std::pow(double(max_tracks), double(i_edge) / double(n_bins - 1)));
+    if (edge > edges.back())
+      edges.push_back(edge);
+  }
+  return edges;
+}
+
+/**
+ * @brief Least squares polynomial of the given degree in z = (u - mean) / sigma from the raw moments in u.
+ * Coefficients are converted back to u, returns false if the system is singular.
+ */
+bool SolveCentred(const std::array<double, 5> &sum_u, const std::array<double, 3> &sum_tu,
+                  int degree, std::vector<double> &coefficients) {
+  const double s0 = sum_u[0];
+  const double mean = sum_u[1] / s0;
+  const double sigma = std::sqrt(std::max(sum_u[2] / s0 - mean * mean, 0.));
+  if (!(sigma > 1e-9 * std::max(std::abs(mean), 1e-9)))
+    return false;
+
+  /* sum of ((u - mean) / sigma)^k via the binomial expansion */
+  auto centred = [mean, sigma](const double *raw, int k) {
+    double result = 0.;
+    double binomial = 1.;
+    for (int j = 0; j <= k; ++j) {
+      result += binomial * std::pow(-mean, k - j) * raw[j];
+      binomial = binomial * (k - j) / (j + 1);
+    }
+    return result / std::pow(sigma, k);
+  };
+
+  const int n_par = degree + 1;
+  TMatrixD normal(n_par, n_par);
+  TVectorD rhs(n_par);
+  for (int i = 0; i < n_par; ++i) {
+    rhs[i] = centred(sum_tu.data(), i);
+    for (int j = 0; j < n_par; ++j) {
+      normal(i, j) = centred(sum_u.data(), i + j);
+    }
+  }
+  TDecompSVD svd(normal);
+  bool ok = false;
+  const auto solution = svd.Solve(rhs, ok);
+  if (!ok || svd.Condition() > 1e12)
+    return false;
+
+  /* t = sum a_k ((u - mean) / sigma)^k expanded in powers of u */
+  coefficients.assign(n_par, 0.);
+  for (int k = 0; k < n_par; ++k) {
+    const double a_k = solution[k] / std::pow(sigma, k);
+    double binomial = 1.;
+    for (int j = 0; j <= k; ++j) {
+      coefficients[j] += a_k * binomial * std::pow(-mean, k - j);
+      binomial = binomial * (k - j) / (j + 1);
+    }
+  }
+  return true;
+}
+
+}
+
+ScalingProfile::ScalingProfile(size_t max_tracks, size_t n_bins, size_t warmup_events) :
+    scale_(double(std::max<size_t>(max_tracks, 1))),
+    warmup_events_(warmup_events),
+    edges_(LogEdges(max_tracks, n_bins)) {}
+
+ScalingProfile::~ScalingProfile() = default;
+ScalingProfile::ScalingProfile(ScalingProfile &&) noexcept = default;
+ScalingProfile &ScalingProfile::operator=(ScalingProfile &&) noexcept = default;
+
+void ScalingProfile::EndEvent(size_t n_tracks) {
+  const double time = std::chrono::duration<double, std::micro>(
+      std::chrono::steady_clock::now() - time_at_begin_).count();
+  ++n_events_;
+  if (n_events_ <= warmup_events_)
+    return;
+
+  if (!profile_) {
+    profile_ = std::make_unique<TProfile>("scaling_profile", ";number of tracks;time (#mus)",
+                                          int(edges_.size() - 1), edges_.data(), "s");
+    profile_->SetDirectory(nullptr);
+  }
+  profile_->Fill(double(n_tracks), time);
+  max_tracks_seen_ = std::max(max_tracks_seen_, n_tracks);
+
+  const double u = double(n_tracks) / scale_;
+  double u_pow = 1.;
+  for (size_t k = 0; k < sum_u_.size(); ++k) {
+    if (k < sum_tu_.size())
+      sum_tu_[k] += time * u_pow;
+    sum_u_[k] += u_pow;
+    u_pow *= u;
+  }
+}
+
+ScalingProfile::Fit ScalingProfile::FitCosts() const {
+  Fit fit;
+  std::vector<double> coefficients;
+
+  /* linear */
+  if (sum_u_[0] < 2 || !SolveCentred(sum_u_, sum_tu_, 1, coefficients))
+    return fit;
+  fit.per_event_linear = coefficients[0];
+  fit.per_track_linear = coefficients[1] / scale_;
+  fit.per_event = fit.per_event_linear;
+  fit.per_track = fit.per_track_linear;
+  fit.ok = true;
+
+  /* quadratic */
+  if (sum_u_[0] < 3 || !SolveCentred(sum_u_, sum_tu_, 2, coefficients))
+    return fit;
+  fit.per_event = coefficients[0];
+  fit.per_track = coefficients[1] / scale_;
+  fit.quadratic = coefficients[2] / (scale_ * scale_);
+  return fit;
+}
+
+void ScalingProfile::Report(std::ostream &os, const std::string &task_name) const {
+  const size_t n_steady_events = size_t(sum_u_[0]);
+  os << task_name << ": scaling profile of " << n_steady_events << " events after warm-up of "
+     << warmup_events_ << " events" << std::endl;
+  if (n_steady_events == 0 || !profile_)
+    return;
+
+  os << task_name << ": " << std::setw(12) << "tracks" << std::setw(10) << "events"
+     << std::setw(14) << "mean (us)" << std::setw(14) << "rms (us)" << std::endl;
+  const auto axis = profile_->GetXaxis();
+  for (int i_bin = 1; i_bin <= axis->GetNbins() + 1; ++i_bin) {
+    const auto n_bin_events = size_t(profile_->GetBinEntries(i_bin));
+    if (n_bin_events == 0)
+      continue;
+    const bool is_overflow = i_bin > axis->GetNbins();
+    const auto range = std::to_string(size_t(axis->GetBinLowEdge(i_bin))) + "-" +
+        std::to_string(is_overflow ? max_tracks_seen_ : size_t(axis->GetBinUpEdge(i_bin)) - 1);
+    os << task_name << ": " << std::setw(12) << range << std::setw(10) << n_bin_events
+       << std::setw(14) << profile_->GetBinContent(i_bin) << std::setw(14) << profile_->GetBinError(i_bin)
+       << std::endl;
+  }
+
+  const auto fit = FitCosts();
+  if (!fit.ok) {
+    os << task_name << ": not enough spread of the multiplicity to fit the costs" << std::endl;
+    return;
+  }
+  os << task_name << ": linear fit: " << fit.per_event_linear << " us per event + "
+     << fit.per_track_linear << " us per track" << std::endl;
+  if (fit.quadratic != 0.) {
+    /* contribution of the quadratic term at the mean multiplicity relative to the linear one */
+    const double mean_tracks = scale_ * sum_u_[1] / sum_u_[0];
+    const double nonlinearity = fit.per_track != 0. ? fit.quadratic * mean_tracks / fit.per_track : 0.;
+    os << task_name << ": quadratic fit: " << fit.per_event << " us per event + "
+       << fit.per_track << " us per track + " << fit.quadratic << " us per track^2"
+       << " (" << 100. * nonlinearity << "% of the linear term at " << mean_tracks << " tracks)" << std::endl;
+  }
+}
+
+void ScalingProfile::Record(TList *list, const std::string &task_name) const {
+  if (!profile_)
+    return;
+  auto profile = static_cast<TProfile *>(profile_->Clone((task_name + "_scaling_profile").c_str()));
+  profile->SetDirectory(nullptr);
+  list->Add(profile);
+
+  const auto fit = FitCosts();
+  if (!fit.ok)
+    return;
+  list->Add(new TParameter<double>((task_name + "_scaling_per_event_us").c_str(), fit.per_event_linear));
+  list->Add(new TParameter<double>((task_name + "_scaling_per_track_us").c_str(), fit.per_track_linear));
+  list->Add(new TParameter<double>((task_name + "_scaling_quadratic_us").c_str(), fit.quadratic));
+}
@@ -0,0 +1,77 @@
+//
+// Created by eugene on 21/04/2021.
+//
+
+#ifndef ATPIDTASK_COMMONS_SCALINGPROFILE_HPP_
+#define ATPIDTASK_COMMONS_SCALINGPROFILE_HPP_
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+class TList;
+class TProfile;
+
+/**
+ * @brief Wall time of the event processing against the number of tracks.
+ *
+ * Events are accumulated in a TProfile with logarithmic bins of multiplicity
+ * up to max_tracks (the last bin takes the overflow) together with the moments
+ * needed for the least squares fit t = per_event + per_track * n + c2 * n^2
+ * over all events. The moments are accumulated in n / max_tracks, the fit is
+ * solved in the centred and scaled multiplicity. A significant quadratic term
+ * means that the processing scales worse than linearly.
+ * The first warmup_events events are not accounted.
+ */
+class ScalingProfile {
+ public:
+  explicit ScalingProfile(size_t max_tracks = 10000, size_t n_bins = 40, size_t warmup_events = 10);
+  ~ScalingProfile();
+  ScalingProfile(ScalingProfile &&) noexcept;
+  ScalingProfile &operator=(ScalingProfile &&) noexcept;
+
+  void BeginEvent() {
+    time_at_begin_ = std::chrono::steady_clock::now();
+  }
+  void EndEvent(size_t n_tracks);
+
+  struct Fit {
+    bool ok{false};
+    /* microseconds */
+    double per_event{0.};
+    double per_track{0.};
+    /* linear fit */
+    double per_event_linear{0.};
+    double per_track_linear{0.};
+    /* quadratic coefficient, microseconds per track^2 */
+    double quadratic{0.};
+  };
+  Fit FitCosts() const;
+
+  void Report(std::ostream &os, const std::string &task_name) const;
+  /**
+   * adds '<task>_scaling_per_event_us', '<task>_scaling_per_track_us' and '<task>_scaling_quadratic_us'
+   * parameters and the TProfile '<task>_scaling_profile' of the time (us) against the number of tracks
+   */
+  void Record(TList *list, const std::string &task_name) const;
+
+ private:
+  double scale_;
+  size_t warmup_events_;
+  std::chrono::steady_clock::time_point time_at_begin_;
+
+  size_t n_events_{0};
+  size_t max_tracks_seen_{0};
+  std::vector<double> edges_;
+  /* spread "s", the bin error is the RMS of the time, created with the first accounted event */
+  std::unique_ptr<TProfile> profile_;
+  /* sums of u^k, k = 0..4 and t * u^k, k = 0..2, u = n / scale_ */
+  std::array<double, 5> sum_u_{0., 0., 0., 0., 0.};
+  std::array<double, 3> sum_tu_{0., 0., 0.};
+};
+
+#endif //ATPIDTASK_COMMONS_SCALINGPROFILE_HPP_
@@ -0,0 +1,281 @@
+//
+// Created by eugene on 19/04/2021.
+//
+
+#include "SharedTables.hpp"
+
+#include <TH1.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace SharedTables {
+
+namespace {
+
+constexpr uint64_t kFnvPrime = 0x100000001b3ULL;
+
+uint64_t Align(uint64_t pos) {
+  return (pos + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+std::string SegmentName(const std::string &prefix, uint64_t checksum) {
+  char checksum_hex[17];
+  std::snprintf(checksum_hex, sizeof(checksum_hex), "%016llx", (unsigned long long) checksum);
+  return "/" + prefix + "_" + checksum_hex;
+}
+
+}
+
+uint64_t FileStatChecksum(const std::string &file_name, uint64_t checksum) {
+  struct stat file_stat{};
+  if (::stat(file_name.c_str(), &file_stat) != 0)
+    throw std::runtime_error("SharedTables: unable to stat '" + file_name + "': " + std::strerror(errno));
+  const uint64_t identity[] = {
+      uint64_t(file_stat.st_dev), uint64_t(file_stat.st_ino), uint64_t(file_stat.st_size),
+      uint64_t(file_stat.st_mtim.tv_sec), uint64_t(file_stat.st_mtim.tv_nsec)
+  };
+  for (auto value : identity) {
+    for (int i_byte = 0; i_byte < 8; ++i_byte) {
+      checksum = (checksum ^ ((value >> (8 * i_byte)) & 0xff)) * kFnvPrime;
+    }
+  }
+  return checksum;
+}
+
+uint64_t StringChecksum(const std::string &value, uint64_t checksum) {
+  for (unsigned char c : value) {
+    checksum = (checksum ^ c) * kFnvPrime;
+  }
+  return checksum;
+}
+
+std::unique_ptr<Segment> Segment::Open(const std::string &prefix, uint64_t checksum,
+                                       const std::function<TableSet()> &build,
+                                       double timeout_s) {
+  std::unique_ptr<Segment> segment(new Segment);
+  segment->name_ = SegmentName(prefix, checksum);
+
+  std::unique_ptr<TableSet> tables;
+  while (true) {
+    int fd = ::shm_open(segment->name_.c_str(), O_RDONLY, 0);
+    if (fd >= 0) {
+      if (segment->Attach(fd, checksum, timeout_s))
+        return segment;
+      std::cout << "SharedTables: '" << segment->name_ << "' was left incomplete, creating it again" << std::endl;
+      ::shm_unlink(segment->name_.c_str());
+      continue;
+    }
+    if (errno != ENOENT)
+      throw std::runtime_error("SharedTables: unable to open '" + segment->name_ + "': " + std::strerror(errno));
+
+    /* tables are built before the segment is created, the loser of the race to create it throws them away */
+    if (!tables)
+      tables = std::make_unique<TableSet>(build());
+    fd = ::shm_open(segment->name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+    if (fd >= 0) {
+      /* held until the segment is complete, released by the kernel if the process dies */
+      if (::flock(fd, LOCK_EX) != 0) {
+        const std::string error = std::strerror(errno);
+        ::close(fd);
+        ::shm_unlink(segment->name_.c_str());
+        throw std::runtime_error("SharedTables: unable to lock '" + segment->name_ + "': " + error);
+      }
+      segment->Create(fd, *tables, checksum);
+      return segment;
+    }
+    if (errno != EEXIST)
+      throw std::runtime_error("SharedTables: unable to create '" + segment->name_ + "': " + std::strerror(errno));
+  }
+}
+
+void Segment::Create(int fd, const TableSet &tables, uint64_t checksum) {
+  uint64_t pos = Align(sizeof(SegmentHeader) + tables.size() * sizeof(TableRecord));
+  std::vector<TableRecord> records(tables.size());
+  for (size_t i_table = 0; i_table < tables.size(); ++i_table) {
+    auto &&[table_name, values] = tables[i_table];
+    if (table_name.size() >= kNameLength)
+      throw std::runtime_error("SharedTables: name '" + table_name + "' is too long");
+    std::memset(&records[i_table], 0, sizeof(TableRecord));
+    std::strncpy(records[i_table].name, table_name.c_str(), kNameLength - 1);
+    records[i_table].data_pos = pos;
+    records[i_table].n_values = values.size();
+    pos = Align(pos + values.size() * sizeof(float));
+  }
+  size_ = pos;
+
+  if (::ftruncate(fd, off_t(size_)) != 0) {
+    ::close(fd);
+    ::shm_unlink(name_.c_str());
+    throw std::runtime_error("SharedTables: unable to allocate '" + name_ + "'");
+  }
+  void *mapped = ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapped == MAP_FAILED) {
+    ::close(fd);
+    ::shm_unlink(name_.c_str());
+    throw std::runtime_error("SharedTables: unable to map '" + name_ + "'");
+  }
+  auto data = static_cast<char *>(mapped);
+
+  auto header = reinterpret_cast<SegmentHeader *>(data);
+  std::memcpy(header->magic, kMagic, sizeof(kMagic));
+  header->n_tables = uint32_t(tables.size());
+  header->checksum = checksum;
+  header->size = size_;
+  std::memcpy(data + sizeof(SegmentHeader), records.data(), records.size() * sizeof(TableRecord));
+  for (size_t i_table = 0; i_table < tables.size(); ++i_table) {
+    auto &values = tables[i_table].second;
+    std::memcpy(data + records[i_table].data_pos, values.data(), values.size() * sizeof(float));
+  }
+  /* the tables are visible to the attached processes before the state */
+  __atomic_store_n(&header->state, uint32_t(kReady), __ATOMIC_RELEASE);
+  ::mprotect(mapped, size_, PROT_READ);
+  ::flock(fd, LOCK_UN);
+
+  /* the segment is unlocked between shm_open() and flock(): an attacher may have
+     taken it for abandoned and unlinked it. The tables stay valid in the mapping
+     of this process, the other processes build and share another copy */
+  struct stat own_stat{}, named_stat{};
+  const int named_fd = ::shm_open(name_.c_str(), O_RDONLY, 0);
+  is_published_ = named_fd >= 0 && ::fstat(fd, &own_stat) == 0 && ::fstat(named_fd, &named_stat) == 0 &&
+      own_stat.st_dev == named_stat.st_dev && own_stat.st_ino == named_stat.st_ino;
+  if (named_fd >= 0)
+    ::close(named_fd);
+  ::close(fd);
+
+  is_creator_ = true;
+  data_ = data;
+  header_ = header;
+  tables_ = reinterpret_cast<const TableRecord *>(data_ + sizeof(SegmentHeader));
+}
+
+bool Segment::Attach(int fd, uint64_t checksum, double timeout_s) {
+  using clock = std::chrono::steady_clock;
+  const auto deadline = clock::now() + std::chrono::duration<double>(timeout_s);
+  /* an incomplete segment nobody holds the lock of was left by a crashed creator */
+  auto is_abandoned = [fd]() {
+    if (::flock(fd, LOCK_SH | LOCK_NB) != 0)
+      return false;
+    ::flock(fd, LOCK_UN);
+    return true;
+  };
+  auto wait = [&]() {
+    if (clock::now() > deadline) {
+      throw std::runtime_error("SharedTables: '" + name_ + "' is not complete in time, "
+                               "its creator is still running");
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  };
+
+  try {
+    /* the creator may not have allocated the segment yet */
+    struct stat segment_stat{};
+    while (true) {
+      if (::fstat(fd, &segment_stat) != 0)
+        throw std::runtime_error("SharedTables: unable to stat '" + name_ + "'");
+      if (size_t(segment_stat.st_size) >= sizeof(SegmentHeader))
+        break;
+      /* the state is checked again after the lock, the creator might have just finished */
+      if (is_abandoned() && ::fstat(fd, &segment_stat) == 0 && size_t(segment_stat.st_size) < sizeof(SegmentHeader)) {
+        ::close(fd);
+        return false;
+      }
+      wait();
+    }
+    size_ = size_t(segment_stat.st_size);
+    void *mapped = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED)
+      throw std::runtime_error("SharedTables: unable to map '" + name_ + "'");
+    data_ = static_cast<const char *>(mapped);
+    header_ = reinterpret_cast<const SegmentHeader *>(data_);
+
+    while (__atomic_load_n(&header_->state, __ATOMIC_ACQUIRE) != kReady) {
+      if (is_abandoned() && __atomic_load_n(&header_->state, __ATOMIC_ACQUIRE) != kReady) {
+        ::munmap(const_cast<char *>(data_), size_);
+        data_ = nullptr;
+        header_ = nullptr;
+        ::close(fd);
+        return false;
+      }
+      wait();
+    }
+  } catch (...) {
+    ::close(fd);
+    throw;
+  }
+  ::close(fd);
+
+  if (std::memcmp(header_->magic, kMagic, sizeof(kMagic)) != 0 ||
+      header_->checksum != checksum || header_->size != size_) {
+    throw std::runtime_error("SharedTables: '" + name_ + "' has unknown format");
+  }
+  tables_ = reinterpret_cast<const TableRecord *>(data_ + sizeof(SegmentHeader));
+  return true;
+}
+
+Segment::~Segment() {
+  if (data_)
+    ::munmap(const_cast<char *>(data_), size_);
+}
+
+void Segment::Print() const {
+  std::cout << "SharedTables: " << (is_creator_ ? "created '" : "attached to '") << name_ << "', "
+            << GetNTables() << " tables, " << size_ / 1024 << " kB"
+            << (is_published_ ? "" : " (unlinked by another process, not shared)") << std::endl;
+}
+
+std::vector<float> PackGrid(const TH1 &binning, const std::function<float(int global_bin)> &value) {
+  const int n_dims = binning.GetDimension();
+  const TAxis *axes[3] = {binning.GetXaxis(), binning.GetYaxis(), binning.GetZaxis()};
+
+  std::vector<float> table;
+  table.push_back(float(n_dims));
+  for (int i_axis = 0; i_axis < n_dims; ++i_axis) {
+    table.push_back(float(axes[i_axis]->GetNbins()));
+  }
+  for (int i_axis = 0; i_axis < n_dims; ++i_axis) {
+    for (int i_bin = 1; i_bin <= axes[i_axis]->GetNbins() + 1; ++i_bin) {
+      table.push_back(float(axes[i_axis]->GetBinLowEdge(i_bin)));
+    }
+  }
+  for (int global_bin = 0; global_bin < binning.GetNcells(); ++global_bin) {
+    table.push_back(value(global_bin));
+  }
+  return table;
+}
+
+GridView::GridView(const float *table, uint64_t n_values) {
+  if (n_values < 1 || table[0] < 1 || table[0] > 3)
+    throw std::runtime_error("SharedTables: bad grid");
+  n_dims_ = int(table[0]);
+  uint64_t pos = 1 + n_dims_;
+  uint64_t n_cells = 1;
+  for (int i_axis = 0; i_axis < n_dims_; ++i_axis) {
+    n_bins_[i_axis] = int(table[1 + i_axis]);
+    edges_[i_axis] = table + pos;
+    pos += n_bins_[i_axis] + 1;
+    n_cells *= n_bins_[i_axis] + 2;
+  }
+  if (pos + n_cells != n_values)
+    throw std::runtime_error("SharedTables: bad grid size");
+  values_ = table + pos;
+}
+
+int GridView::FindBin(int i_axis, float x) const {
+  const float *edges = edges_[i_axis];
+  return int(std::upper_bound(edges, edges + n_bins_[i_axis] + 1, x) - edges);
+}
+
+}
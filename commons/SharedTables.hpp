@@ -0,0 +1,149 @@
+//
+// Created by eugene on 19/04/2021.
+//
+
+#ifndef ATPIDTASK_COMMONS_SHAREDTABLES_HPP_
+#define ATPIDTASK_COMMONS_SHAREDTABLES_HPP_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+class TH1;
+
+/**
+ * @brief Read-only lookup tables published in a named POSIX shared memory segment.
+ *
+ * Tasks running concurrently on the node with the same inputs share one copy
+ * of the tables instead of loading their own. The segment name contains the
+ * checksum of the sources, thus changed inputs never attach to a stale segment.
+ * The first process creates the segment, the others wait until it is complete
+ * and map it read-only. The creator holds an exclusive flock() on the segment
+ * until it is complete: a segment which is unlocked but incomplete was left by
+ * a crashed creator, it is unlinked and created again by the next process.
+ * The lock can only be taken after the segment is created, an attacher coming
+ * in between unlinks the new segment as well. This is tolerated: the creator
+ * keeps using its own mapping and the others share a second copy of the tables.
+ *
+ * Complete segments outlive the processes so that later jobs on the node
+ * attach as well. They are not removed automatically (a segment of the old
+ * inputs stays until the reboot); remove them with 'rm /dev/shm/<prefix>_*'
+ * when no job is running.
+ *
+ * Layout of the segment:
+ *   SegmentHeader
+ *   TableRecord[n_tables]
+ *   float values of every table, sections are 64-byte aligned
+ */
+namespace SharedTables {
+
+constexpr char kMagic[8] = {'A', 'T', 'P', 'I', 'D', 'S', 'T', '1'};
+constexpr size_t kNameLength = 64;
+constexpr uint64_t kAlignment = 64;
+
+enum SegmentState : uint32_t {
+  kBuilding = 0,
+  kReady = 1
+};
+
+struct SegmentHeader {
+  char magic[8];
+  uint32_t state;
+  uint32_t n_tables;
+  uint64_t checksum;
+  uint64_t size;
+};
+
+struct TableRecord {
+  char name[kNameLength];
+  uint64_t data_pos;
+  uint64_t n_values;
+};
+
+using TableSet = std::vector<std::pair<std::string, std::vector<float>>>;
+
+/* FNV-1a of the identity of the file: device, inode, size and modification time, the contents are not read */
+uint64_t FileStatChecksum(const std::string &file_name, uint64_t checksum = 0xcbf29ce484222325ULL);
+/* FNV-1a of the string, e.g. to account parameters the tables depend on */
+uint64_t StringChecksum(const std::string &value, uint64_t checksum = 0xcbf29ce484222325ULL);
+
+class Segment {
+ public:
+  /**
+   * @brief Attaches to the segment '/<prefix>_<checksum>' or creates it with the tables given by build.
+   * build is called only if the segment does not exist yet.
+   * Throws if the segment is not complete after timeout_s seconds while its creator is alive.
+   */
+  static std::unique_ptr<Segment> Open(const std::string &prefix, uint64_t checksum,
+                                       const std::function<TableSet()> &build,
+                                       double timeout_s = 120.);
+  ~Segment();
+  Segment(const Segment &) = delete;
+  Segment &operator=(const Segment &) = delete;
+
+  const std::string &GetName() const { return name_; }
+  bool IsCreator() const { return is_creator_; }
+  /* false if the segment of the creator was unlinked before it was complete, see above */
+  bool IsPublished() const { return is_published_; }
+  size_t GetSize() const { return size_; }
+
+  uint32_t GetNTables() const { return header_->n_tables; }
+  std::string GetTableName(uint32_t i_table) const { return tables_[i_table].name; }
+  const float *GetTable(uint32_t i_table) const {
+    return reinterpret_cast<const float *>(data_ + tables_[i_table].data_pos);
+  }
+  uint64_t GetTableSize(uint32_t i_table) const { return tables_[i_table].n_values; }
+
+  void Print() const;
+
+ private:
+  Segment() = default;
+  void Create(int fd, const TableSet &tables, uint64_t checksum);
+  /* false if the segment was left incomplete by a crashed creator */
+  bool Attach(int fd, uint64_t checksum, double timeout_s);
+
+  std::string name_;
+  bool is_creator_{false};
+  bool is_published_{true};
+  const char *data_{nullptr};
+  size_t size_{0};
+  const SegmentHeader *header_{nullptr};
+  const TableRecord *tables_{nullptr};
+};
+
+/**
+ * @brief Values on the binning of a histogram (up to 3D) packed into a table:
+ *   n_dims, n_bins[n_dims], edges of every axis, values[n_cells]
+ * Cells include underflow and overflow and are ordered as the global bins of TH1.
+ */
+std::vector<float> PackGrid(const TH1 &binning, const std::function<float(int global_bin)> &value);
+
+class GridView {
+ public:
+  GridView() = default;
+  GridView(const float *table, uint64_t n_values);
+
+  bool IsValid() const { return values_ != nullptr; }
+  float Eval(float x, float y) const {
+    return values_[FindBin(0, x) + (n_bins_[0] + 2) * FindBin(1, y)];
+  }
+  float Eval(float x, float y, float z) const {
+    return values_[FindBin(0, x) + (n_bins_[0] + 2) * (FindBin(1, y) + (n_bins_[1] + 2) * FindBin(2, z))];
+  }
+
+ private:
+  /* same convention as TAxis::FindFixBin: 0 - underflow, n_bins + 1 - overflow */
+  int FindBin(int i_axis, float x) const;
+
+  int n_dims_{0};
+  int n_bins_[3]{0, 0, 0};
+  const float *edges_[3]{nullptr, nullptr, nullptr};
+  const float *values_{nullptr};
+};
+
+}
+
+#endif //ATPIDTASK_COMMONS_SHAREDTABLES_HPP_
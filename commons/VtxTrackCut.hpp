@@ -6,6 +6,7 @@
 #define ATPIDTASK_COMMONS_VTXTRACKCUT_HPP_
 
 #include <cassert>
+#include <cmath>
 #include <TTree.h>
 #include <ati2/ATI2.hpp>
 
@@ -17,8 +18,21 @@ struct VtxTrackCut {
   const int nhits_vtpc_min;
   const int nhits_total_min;
 
-  const float ratio_nhits_nhits_pot_min;
-  const float ratio_nhits_nhits_pot_max;
+  /* double, the float ratio of the exact fractions like 33/60 passes the cut at 0.55 */
+  const double ratio_nhits_nhits_pot_min;
+  const double ratio_nhits_nhits_pot_max;
+
+  /* standard selection of the analysis: |DCA| < 2, 1 cm, > 15 VTPC hits, > 30 hits, 0.55 < hits/potential < 1.1 */
+  static VtxTrackCut Standard() {
+    return VtxTrackCut{
+        .dcax_max = 2.,
+        .dcay_max = 1.,
+        .nhits_vtpc_min = 15,
+        .nhits_total_min = 31,
+        .ratio_nhits_nhits_pot_min = 0.55,
+        .ratio_nhits_nhits_pot_max = 1.10
+    };
+  }
 
   ATI2::Variable v_dca_x;
   ATI2::Variable v_dca_y;
@@ -40,7 +54,7 @@ struct VtxTrackCut {
         "dcax", "dcay");
   }
 
-  bool CheckVtxTrack(ATI2::BranchChannel &vtx_track) const {
+  bool CheckVtxTrack(const ATI2::BranchChannel &vtx_track) const {
     int nhits_total =
         vtx_track[v_nhits_vtpc1].GetInt() +
             vtx_track[v_nhits_vtpc2].GetInt() +
@@ -52,10 +66,14 @@ struct VtxTrackCut {
         vtx_track[v_nhits_pot_vtpc1].GetInt() +
             vtx_track[v_nhits_pot_vtpc2].GetInt() +
             vtx_track[v_nhits_pot_mtpc].GetInt();
-    float ratio_nhits_nhits_pot = float(nhits_total) / float(nhits_pot_total);
 
-    auto dca_x = vtx_track[v_dca_x];
-    auto dca_y = vtx_track[v_dca_y];
+    return CheckValues(nhits_total, nhits_vtpc, nhits_pot_total,
+                       vtx_track[v_dca_x].GetVal(), vtx_track[v_dca_y].GetVal());
+  }
+
+  /* the same cut for the tasks reading AnalysisTree without ATI2 */
+  bool CheckValues(int nhits_total, int nhits_vtpc, int nhits_pot_total, float dca_x, float dca_y) const {
+    const double ratio_nhits_nhits_pot = float(nhits_total) / float(nhits_pot_total);
 
     return
         nhits_total >= nhits_total_min &&
@@ -63,8 +81,8 @@ struct VtxTrackCut {
             nhits_pot_total > 0 &&
             ratio_nhits_nhits_pot > ratio_nhits_nhits_pot_min &&
             ratio_nhits_nhits_pot < ratio_nhits_nhits_pot_max &&
-            abs(dca_x) < dcax_max &&
-            abs(dca_y) < dcay_max;
+            std::abs(dca_x) < dcax_max &&
+            std::abs(dca_y) < dcay_max;
   }
 };
 
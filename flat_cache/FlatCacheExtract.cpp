@@ -0,0 +1,93 @@
+//
+// Created by eugene on 22/03/2021.
+//
+
+#include "FlatCacheExtract.hpp"
+
+#include <boost/algorithm/string.hpp>
+
+TASK_IMPL(FlatCacheExtract)
+
+boost::program_options::options_description FlatCacheExtract::GetBoostOptions() {
+  using namespace boost::program_options;
+
+  options_description desc(GetName() + " options");
+  desc.add_options()
+      ("flat-cache", value(&output_file_name_)->required(), "Output flat cache file")
+      ("columns", value(&column_definitions_)->multitoken()->required(),
+       "Columns to extract, format <branch>:<field>[/F|/I],<field>[/F|/I],... (float by default)")
+      ("matchings", value(&matching_names_)->multitoken(),
+       "Matchings to extract, stored as the branch with columns 'from' and 'to'");
+  return desc;
+}
+
+void FlatCacheExtract::PreInit() {
+  writer_ = std::make_unique<FlatCache::Writer>(output_file_name_);
+}
+
+void FlatCacheExtract::UserInit(std::map<std::string, void *> &map) {
+  for (auto &definition : column_definitions_) {
+    auto colon_pos = definition.find(':');
+    if (colon_pos == std::string::npos)
+      throw std::runtime_error("Bad column definition '" + definition + "'");
+
+    BranchDef branch_def;
+    auto branch_name = definition.substr(0, colon_pos);
+    branch_def.branch = GetInBranch(branch_name);
+    branch_def.branch_id = writer_->AddBranch(branch_name);
+
+    std::vector<std::string> fields;
+    boost::split(fields, definition.substr(colon_pos + 1), boost::is_any_of(","));
+    for (auto &field : fields) {
+      auto type = FlatCache::ColumnType::kFloat;
+      if (boost::ends_with(field, "/I")) {
+        type = FlatCache::ColumnType::kInt;
+        field.resize(field.size() - 2);
+      } else if (boost::ends_with(field, "/F")) {
+        field.resize(field.size() - 2);
+      }
+      branch_def.columns.push_back({branch_def.branch->GetVar(field), type,
+                                    writer_->AddColumn(branch_def.branch_id, field, type)});
+    }
+    branches_.emplace_back(std::move(branch_def));
+  }
+
+  for (auto &matching_name : matching_names_) {
+    MatchingDef matching_def;
+    matching_def.matching = static_cast<AnalysisTree::Matching *>(map.at(matching_name));
+    matching_def.branch_id = writer_->AddBranch(matching_name);
+    matching_def.from_column_id = writer_->AddColumn(matching_def.branch_id, "from", FlatCache::ColumnType::kInt);
+    matching_def.to_column_id = writer_->AddColumn(matching_def.branch_id, "to", FlatCache::ColumnType::kInt);
+    matchings_.emplace_back(matching_def);
+  }
+}
+
+void FlatCacheExtract::UserExec() {
+  for (auto &branch_def : branches_) {
+    for (const auto &channel : branch_def.branch->Loop()) {
+      writer_->FillEntry(branch_def.branch_id);
+      for (auto &column : branch_def.columns) {
+        if (column.type == FlatCache::ColumnType::kInt) {
+          writer_->Fill(column.column_id, int(channel[column.var].GetInt()));
+        } else {
+          writer_->Fill(column.column_id, float(channel[column.var].GetVal()));
+        }
+      }
+    }
+  }
+
+  for (auto &matching_def : matchings_) {
+    for (auto &&[from, to] : matching_def.matching->GetMatches()) {
+      writer_->FillEntry(matching_def.branch_id);
+      writer_->Fill(matching_def.from_column_id, int(from));
+      writer_->Fill(matching_def.to_column_id, int(to));
+    }
+  }
+
+  writer_->EndEvent();
+}
+
+void FlatCacheExtract::UserFinish() {
+  writer_->Close();
+  FlatCache::Reader(output_file_name_).Print();
+}
@@ -0,0 +1,56 @@
+//
+// Created by eugene on 22/03/2021.
+//
+
+#ifndef ATPIDTASK_FLAT_CACHE_FLATCACHEEXTRACT_HPP_
+#define ATPIDTASK_FLAT_CACHE_FLATCACHEEXTRACT_HPP_
+
+#include <at_task/Task.h>
+#include <AnalysisTree/Matching.hpp>
+
+#include "FlatCache.hpp"
+
+/**
+ * @brief Writes the declared fields of the input branches to the columnar flat cache
+ */
+class FlatCacheExtract : public UserFillTask {
+
+ public:
+  boost::program_options::options_description GetBoostOptions() override;
+  void PreInit() override;
+  void PostFinish() override {}
+
+  void UserInit(std::map<std::string, void *> &map) override;
+  void UserExec() override;
+  void UserFinish() override;
+
+ private:
+  struct ColumnDef {
+    ATI2::Variable var;
+    FlatCache::ColumnType type;
+    size_t column_id;
+  };
+  struct BranchDef {
+    ATI2::Branch *branch{nullptr};
+    size_t branch_id;
+    std::vector<ColumnDef> columns;
+  };
+  struct MatchingDef {
+    AnalysisTree::Matching *matching{nullptr};
+    size_t branch_id;
+    size_t from_column_id;
+    size_t to_column_id;
+  };
+
+  std::string output_file_name_;
+  std::vector<std::string> column_definitions_;
+  std::vector<std::string> matching_names_;
+
+  std::unique_ptr<FlatCache::Writer> writer_;
+  std::vector<BranchDef> branches_;
+  std::vector<MatchingDef> matchings_;
+
+ TASK_DEF(FlatCacheExtract, 0)
+};
+
+#endif //ATPIDTASK_FLAT_CACHE_FLATCACHEEXTRACT_HPP_
@@ -6,12 +6,15 @@
 
 #include <TKey.h>
 #include <TEfficiency.h>
-#include <TLorentzVector.h>
 
+#include <AnalysisTree/Constants.hpp>
 #include <AnalysisTree/DataHeader.hpp>
+#include <AnalysisTree/EventHeader.hpp>
 
 #include <pid_new/core/PdgHelper.h>
 
+#include <cmath>
+#include <limits>
 #include <regex>
 #include <boost/lexical_cast.hpp>
 
@@ -29,6 +32,8 @@ struct PiddEdx::Efficiency {
 boost::program_options::options_description PiddEdx::GetBoostOptions() {
   using namespace boost::program_options;
 
+  const auto standard_track_cut = VtxTrackCut::Standard();
+
   options_description desc(GetName() + " options");
   desc.add_options()
       ("getter-file", value(&getter_file_)->required(), "Path to ROOT file with getter")
@@ -37,12 +42,68 @@ boost::program_options::options_description PiddEdx::GetBoostOptions() {
       ("dedx-field", value(&dedx_field_name_)->default_value("dedx_total"), "Name of the field with dEdx")
       ("output-branch", value(&output_branch_name_)->default_value("RecParticles"),
        "Name of the output branch with identified particles")
-      ("efficiency-definitions", value(&efficiency_definitions_)->multitoken(), "Efficiency definitions");;
+      ("purity", value(&purity_)->default_value(0.9f), "Minimal purity of the identified particle")
+      ("purity-thresholds", value(&purity_thresholds_)->multitoken(),
+       "Additional purity thresholds (not below --purity), decisions are stored as bits of the 'purity_mask' field")
+      ("store-probabilities", value(&probability_pdgs_)->multitoken(),
+       "List of PDG codes to store Bayesian probabilities for (fields 'prob_<pdg>', 'prob_m<|pdg|>' for negative codes)")
+      ("output-profile", value(&output_profile_name_)->default_value("full"),
+       "Output schema: 'full' or 'compact' (derived fields y and nhits_ratio are not written)")
+      ("float-precision", value(&float_precision_definitions_)->multitoken(),
+       "Quantize float output fields, format <field>:<absolute precision>")
+      ("copy-track-fields", value(&copy_track_fields_)->default_value(true),
+       "Copy dcax, dcay, nhits and chi2/ndf of the track. Use 'vtx_track_id' to access them otherwise")
+      ("prune-input", value(&prune_input_)->default_value(false),
+       "Read only the branches declared by the task")
+      ("track-cut", value(&use_track_cut_)->default_value(false),
+       "Skip tracks failing the standard VtxTrackCut before PID")
+      ("track-cut-dcax-max", value(&track_cut_dcax_max_)->default_value(standard_track_cut.dcax_max))
+      ("track-cut-dcay-max", value(&track_cut_dcay_max_)->default_value(standard_track_cut.dcay_max))
+      ("track-cut-nhits-vtpc-min", value(&track_cut_nhits_vtpc_min_)->default_value(standard_track_cut.nhits_vtpc_min),
+       "Minimal number of VTPC hits (exclusive)")
+      ("track-cut-nhits-total-min", value(&track_cut_nhits_total_min_)->default_value(standard_track_cut.nhits_total_min),
+       "Minimal total number of hits (inclusive)")
+      ("track-cut-nhits-ratio-min", value(&track_cut_nhits_ratio_min_)->default_value(standard_track_cut.ratio_nhits_nhits_pot_min))
+      ("track-cut-nhits-ratio-max", value(&track_cut_nhits_ratio_max_)->default_value(standard_track_cut.ratio_nhits_nhits_pot_max))
+      ("event-header-branch", value(&event_header_branch_)->default_value("RecEventHeader"),
+       "Name of the branch with event header (used by event cuts)")
+      ("vtx-z-min", value(&vtx_z_min_), "Event cut: minimal z of the vertex")
+      ("vtx-z-max", value(&vtx_z_max_), "Event cut: maximal z of the vertex")
+      ("vtx-quality-field", value(&vtx_quality_field_name_),
+       "Event cut: integer field of the event header with vertex quality")
+      ("vtx-quality-value", value(&vtx_quality_value_)->default_value(0),
+       "Event cut: required value of the vertex quality field")
+      ("min-multiplicity", value(&min_multiplicity_)->default_value(0),
+       "Event cut: minimal number of tracks")
+      ("sample-every", value(&sample_every_)->default_value(1),
+       "Process 1 in N events, selected deterministically by the hash of the event id. "
+       "Tracks of unselected events are not read, they have empty output and the '<task>_sampled' flag unset")
+      ("sample-events", value(&sample_events_)->default_value(0),
+       "Process approximately this number of events (overrides --sample-every)")
+      ("sample-seed", value(&sample_seed_)->default_value(0), "Seed of the event sampling")
+      ("sample-event-id", value(&sample_event_id_)->default_value("RecEventHeader.evt_id"),
+       "Integer field identifying the event for the sampling, <branch>.<field>")
+      ("count-allocations", value(&count_allocations_)->default_value(false),
+       "Report heap allocations per event (requires -DATPID_ALLOCATION_COUNTER=ON)")
+      ("profile-scaling", value(&profile_scaling_)->default_value(false),
+       "Report the processing time per event and per track")
+      ("profile-scaling-max-tracks", value(&profile_scaling_max_tracks_)->default_value(10000),
+       "Upper edge of the logarithmic multiplicity bins of the scaling profile")
+      ("efficiency-definitions", value(&efficiency_definitions_)->multitoken(), "Efficiency definitions");
   return desc;
 }
 
 void PiddEdx::ProcessBoostVM(const boost::program_options::variables_map &vm) {
   UserTask::ProcessBoostVM(vm);
+  use_vtx_z_cut_ = vm.count("vtx-z-min") > 0 || vm.count("vtx-z-max") > 0;
+  if (!vm.count("vtx-z-min"))
+    vtx_z_min_ = -std::numeric_limits<float>::infinity();
+  if (!vm.count("vtx-z-max"))
+    vtx_z_max_ = std::numeric_limits<float>::infinity();
+  use_event_cuts_ = use_vtx_z_cut_ || !vtx_quality_field_name_.empty() || min_multiplicity_ > 0;
+  use_sampling_ = sample_every_ > 1 || sample_events_ > 0;
+  if (profile_scaling_)
+    scaling_profile_ = ScalingProfile(profile_scaling_max_tracks_);
 }
 
 void PiddEdx::PreInit() {
@@ -58,7 +119,13 @@ void PiddEdx::PreInit() {
     throw std::runtime_error("Getter is nullptr");
   }
 
-  SetInputBranchNames({tracks_branch_});
+  std::vector<std::string> input_branches{tracks_branch_};
+  if (use_event_cuts_)
+    input_branches.push_back(event_header_branch_);
+  const auto sample_event_id_branch = sample_event_id_.substr(0, sample_event_id_.find('.'));
+  if (use_sampling_ && !(use_event_cuts_ && sample_event_id_branch == event_header_branch_))
+    input_branches.push_back(sample_event_id_branch);
+  SetInputBranchNames(input_branches);
   SetOutputBranchName(output_branch_name_);
 }
 
@@ -80,93 +147,371 @@ void PiddEdx::UserInit(std::map<std::string, void *> &Map) {
   i_chi2 = vtx_tracks_config.GetFieldId("chi2");
   i_ndf = vtx_tracks_config.GetFieldId("ndf");
 
+  /* Pre-selection */
+  if (use_track_cut_) {
+    track_cut_.emplace(VtxTrackCut{
+        .dcax_max = track_cut_dcax_max_,
+        .dcay_max = track_cut_dcay_max_,
+        .nhits_vtpc_min = track_cut_nhits_vtpc_min_,
+        .nhits_total_min = track_cut_nhits_total_min_,
+        .ratio_nhits_nhits_pot_min = track_cut_nhits_ratio_min_,
+        .ratio_nhits_nhits_pot_max = track_cut_nhits_ratio_max_
+    });
+  }
+  if (use_event_cuts_) {
+    event_header_ = static_cast<AnalysisTree::EventHeader *>(Map.at(event_header_branch_));
+    if (!vtx_quality_field_name_.empty()) {
+      const auto &event_header_config = config_->GetBranchConfig(event_header_branch_);
+      vtx_quality_field_id_ = event_header_config.GetFieldId(vtx_quality_field_name_);
+      if (vtx_quality_field_id_ == AnalysisTree::UndefValueShort) {
+        throw std::runtime_error("Field '" + vtx_quality_field_name_ + "' is not found in '" +
+            event_header_branch_ + "'");
+      }
+      const auto &int_fields = event_header_config.GetMap<int>();
+      if (int_fields.find(vtx_quality_field_name_) == int_fields.end()) {
+        throw std::runtime_error("Field '" + vtx_quality_field_name_ + "' of '" + event_header_branch_ +
+            "' is not an integer field");
+      }
+    }
+  }
+
+  /* Sampling */
+  sampler_.Configure(sample_events_ > 0 ?
+                     EventSampler::EveryForTarget(in_chain_->GetEntries(), sample_events_) : sample_every_,
+                     sample_seed_);
+  if (sampler_.IsEnabled())
+    sampler_.InitEventId(Map, *config_, sample_event_id_);
+
+  auto &read_set = InputReadSet::Instance();
+  if (prune_input_) {
+    read_set.Declare(tracks_branch_, {dedx_field_name_, "q", "dcax", "dcay", "chi2", "ndf",
+                                      "nhits_vtpc1", "nhits_vtpc2", "nhits_mtpc",
+                                      "nhits_pot_vtpc1", "nhits_pot_vtpc2", "nhits_pot_mtpc"});
+    if (use_event_cuts_) {
+      read_set.Declare(event_header_branch_, vtx_quality_field_name_.empty() ?
+                                             std::vector<std::string>{} :
+                                             std::vector<std::string>{vtx_quality_field_name_});
+    }
+    if (sampler_.IsEnabled())
+      read_set.Declare(sampler_.GetEventIdBranch());
+  } else {
+    read_set.DeclareAll();
+  }
+
+  /* Tracks are read only for the events selected by the sampling and passing the vertex cuts */
+  if (use_event_cuts_ || sampler_.IsEnabled()) {
+    in_chain_->SetBranchStatus(tracks_branch_.c_str(), false);
+    in_chain_->SetBranchStatus((tracks_branch_ + ".*").c_str(), false);
+  }
+
   /* Output */
+  output_profile_ = OutputProfile::Parse(output_profile_name_, float_precision_definitions_);
+  o_float_precisions_.clear();
+  auto add_float_field = [this](const std::string &name) -> short {
+    if (output_profile_.Drops(name))
+      return -1;
+    rec_particle_config_.AddField<float>(name);
+    auto field_id = rec_particle_config_.GetFieldId(name);
+    if (o_float_precisions_.size() <= size_t(field_id))
+      o_float_precisions_.resize(field_id + 1, 0.f);
+    o_float_precisions_[field_id] = output_profile_.Precision(name);
+    return field_id;
+  };
+
   rec_particle_config_ = AnalysisTree::BranchConfig(out_branch_, AnalysisTree::DetType::kParticle);
-  rec_particle_config_.AddField<float>("y_cm");
-  rec_particle_config_.AddField<float>("y");
-  y_cm_field_id_ = rec_particle_config_.GetFieldId("y_cm");
-  y_field_id_ = rec_particle_config_.GetFieldId("y");
-
-  rec_particle_config_.AddField<float>("dcax");
-  rec_particle_config_.AddField<float>("dcay");
-  o_dca_x_field_id_ = rec_particle_config_.GetFieldId("dcax");
-  o_dca_y_field_id_ = rec_particle_config_.GetFieldId("dcay");
-
-  rec_particle_config_.AddField<int>("nhits_total");
-  rec_particle_config_.AddField<int>("nhits_vtpc");
-  rec_particle_config_.AddField<int>("nhits_pot_total");
-  rec_particle_config_.AddField<float>("nhits_ratio");
-  o_nhits_total_ = rec_particle_config_.GetFieldId("nhits_total");
-  o_nhits_vtpc_ = rec_particle_config_.GetFieldId("nhits_vtpc");
-  o_nhits_pot_total_ = rec_particle_config_.GetFieldId("nhits_pot_total");
-  o_nhits_ratio_ = rec_particle_config_.GetFieldId("nhits_ratio");
-
-  rec_particle_config_.AddField<float>("chi2_ndf");
-  o_chi2_ndf = rec_particle_config_.GetFieldId("chi2_ndf");
+  y_cm_field_id_ = add_float_field("y_cm");
+  y_field_id_ = add_float_field("y");
+
+  /* index of the source track in the input branch */
+  rec_particle_config_.AddField<int>("vtx_track_id");
+  o_vtx_track_id_ = rec_particle_config_.GetFieldId("vtx_track_id");
+
+  if (copy_track_fields_) {
+    o_dca_x_field_id_ = add_float_field("dcax");
+    o_dca_y_field_id_ = add_float_field("dcay");
+
+    rec_particle_config_.AddField<int>("nhits_total");
+    rec_particle_config_.AddField<int>("nhits_vtpc");
+    rec_particle_config_.AddField<int>("nhits_pot_total");
+    o_nhits_total_ = rec_particle_config_.GetFieldId("nhits_total");
+    o_nhits_vtpc_ = rec_particle_config_.GetFieldId("nhits_vtpc");
+    o_nhits_pot_total_ = rec_particle_config_.GetFieldId("nhits_pot_total");
+    o_nhits_ratio_ = add_float_field("nhits_ratio");
+
+    o_chi2_ndf = add_float_field("chi2_ndf");
+  }
+
+  /* purity */
+  if (!purity_thresholds_.empty()) {
+    if (purity_thresholds_.size() > 32) {
+      throw std::runtime_error("At most 32 purity thresholds are supported");
+    }
+    rec_particle_config_.AddField<int>("purity_mask");
+    o_purity_mask_ = rec_particle_config_.GetFieldId("purity_mask");
+    for (size_t i_threshold = 0; i_threshold < purity_thresholds_.size(); ++i_threshold) {
+      /* only the particles passing --purity are stored, lower thresholds would be always set */
+      if (purity_thresholds_[i_threshold] < purity_) {
+        throw std::runtime_error("Purity threshold " + std::to_string(purity_thresholds_[i_threshold]) +
+            " is below --purity " + std::to_string(purity_));
+      }
+      std::cout << "purity_mask bit " << i_threshold << ": purity >= " << purity_thresholds_[i_threshold] << std::endl;
+    }
+  }
+
+  o_prob_field_ids_.clear();
+  for (auto pdg : probability_pdgs_) {
+    std::string field_name = Form("prob_%s%d", pdg < 0 ? "m" : "", std::abs(pdg));
+    o_prob_field_ids_.emplace_back(pdg, add_float_field(field_name));
+  }
 
   out_config_->AddBranchConfig(rec_particle_config_);
 
   rec_particles_ = new AnalysisTree::Particles;
   out_tree_->Branch(out_branch_.c_str(), &rec_particles_);
+  rec_particles_pool_.SetDetector(rec_particles_);
+  if (sampler_.IsEnabled())
+    sampler_.AddFlagBranch(out_tree_, GetName() + "_sampled");
 }
 
 void PiddEdx::UserExec() {
 
-  auto &particle_config = rec_particle_config_;
+  InputReadSet::Instance().Apply(in_chain_, config_);
+
+  if (!sampler_.Process()) {
+    /* not selected, flagged in '<task>_sampled', tracks are not read */
+    rec_particles_pool_.Reset();
+    rec_particles_pool_.Commit();
+    return;
+  }
+
+  if (profile_scaling_)
+    scaling_profile_.BeginEvent();
+  if (count_allocations_)
+    allocation_stats_.BeginEvent();
 
-  rec_particles_->ClearChannels();
+  rec_particles_pool_.Reset();
 
-  TLorentzVector momentum;
+  const int n_tracks = use_event_cuts_ || sampler_.IsEnabled() ?
+                       PreselectEvent() : int(tracks_->GetNumberOfChannels());
+  n_tracks_total_ += n_tracks;
 
-  for (int i_track = 0; i_track < tracks_->GetNumberOfChannels(); ++i_track) {
-    auto track = tracks_->GetChannel(i_track);
+  EvalTrackHits(n_tracks);
+  IdentifyTracks(n_tracks);
+  EvalRapidities();
+  FillParticles();
+
+  rec_particles_pool_.Commit();
+
+  std::cout << "Identified " << rec_particles_->GetNumberOfChannels() << " particles of " <<
+            n_tracks << " tracks" << std::endl;
+
+  if (count_allocations_)
+    allocation_stats_.EndEvent();
+  if (profile_scaling_)
+    scaling_profile_.EndEvent(size_t(n_tracks));
+}
+
+void PiddEdx::EvalTrackHits(int n_tracks) {
+  if (!track_cut_ && !copy_track_fields_)
+    return;
+  auto &batch = batch_;
+  const auto n = size_t(n_tracks);
+  batch.nhits_vtpc.resize(n);
+  batch.nhits_total.resize(n);
+  batch.nhits_pot_total.resize(n);
+  batch.dca_x.resize(n);
+  batch.dca_y.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    const auto &track = tracks_->GetChannel(i);
+    const int nhits_vtpc = track.GetField<int>(i_nhits_vtpc1_) + track.GetField<int>(i_nhits_vtpc2_);
+    batch.nhits_vtpc[i] = nhits_vtpc;
+    batch.nhits_total[i] = nhits_vtpc + track.GetField<int>(i_nhits_mtpc_);
+    batch.nhits_pot_total[i] = track.GetField<int>(i_nhits_pot_vtpc1_) +
+        track.GetField<int>(i_nhits_pot_vtpc2_) +
+        track.GetField<int>(i_nhits_pot_mtpc_);
+    batch.dca_x[i] = track.GetField<float>(i_dca_x_field_id_);
+    batch.dca_y[i] = track.GetField<float>(i_dca_y_field_id_);
+  }
+
+  if (!track_cut_)
+    return;
+  batch.passed.resize(n);
+  const auto &cut = *track_cut_;
+  for (size_t i = 0; i < n; ++i) {
+    batch.passed[i] = cut.CheckValues(batch.nhits_total[i], batch.nhits_vtpc[i], batch.nhits_pot_total[i],
+                                      batch.dca_x[i], batch.dca_y[i]);
+  }
+}
+
+void PiddEdx::IdentifyTracks(int n_tracks) {
+  auto &batch = batch_;
+  batch.i_track.clear();
+  batch.pid.clear();
+  batch.purity_mask.clear();
+  batch.probabilities.clear();
+  batch.px.clear();
+  batch.py.clear();
+  batch.pz.clear();
+  batch.mass.clear();
+
+  /* the getter has a per-track interface */
+  for (int i_track = 0; i_track < n_tracks; ++i_track) {
+    if (track_cut_ && !batch.passed[i_track]) {
+      ++n_tracks_rejected_;
+      continue;
+    }
+    const auto &track = tracks_->GetChannel(i_track);
     auto qp = track.GetP() * track.GetField<int>(charge_field_id_);
     auto dedx = track.GetField<float>(dedx_field_id_);
-    auto pid = getter_->GetPid(qp, dedx, 0.9);
 
-    if (pid != -1) {
-      auto particle = rec_particles_->AddChannel();
-      particle->Init(particle_config);
-      particle->SetMomentum3(track.GetMomentum3());
-      particle->SetPid(pid);
+    /* Probabilities are evaluated once, all purity decisions are derived from them */
+    const auto probabilities = getter_->GetBayesianProbability(qp, dedx);
+    int pid = -1;
+    double pid_probability = 0.;
+    for (auto &&[pdg, probability] : probabilities) {
+      if (probability > pid_probability) {
+        pid = pdg;
+        pid_probability = probability;
+      }
+    }
+    if (pid == -1 || pid_probability < purity_)
+      continue;
+
+    batch.i_track.push_back(i_track);
+    batch.pid.push_back(pid);
+    int purity_mask = 0;
+    for (size_t i_threshold = 0; i_threshold < purity_thresholds_.size(); ++i_threshold) {
+      if (pid_probability >= purity_thresholds_[i_threshold])
+        purity_mask |= (1 << i_threshold);
+    }
+    batch.purity_mask.push_back(purity_mask);
+    for (auto &&[pdg, field_id] : o_prob_field_ids_) {
+      auto probability_it = probabilities.find(pdg);
+      batch.probabilities.push_back(probability_it == probabilities.end() ? 0.f : float(probability_it->second));
+    }
+    const auto momentum = track.GetMomentum3();
+    batch.px.push_back(momentum.X());
+    batch.py.push_back(momentum.Y());
+    batch.pz.push_back(momentum.Z());
+    batch.mass.push_back(PdgHelper::mass(pid));
+  }
+}
 
-      /* mass */
-      auto mass = PdgHelper::mass(pid);
-      particle->SetMass(mass);
+void PiddEdx::EvalRapidities() {
+  auto &batch = batch_;
+  const size_t n = batch.i_track.size();
+  batch.rapidity.resize(n);
+  const double *px = batch.px.data();
+  const double *py = batch.py.data();
+  const double *pz = batch.pz.data();
+  const double *mass = batch.mass.data();
+  double *rapidity = batch.rapidity.data();
+  /* same arithmetic as TLorentzVector::SetVectM() and Rapidity() */
+  for (size_t i = 0; i < n; ++i) {
+    const double e = std::sqrt(px[i] * px[i] + py[i] * py[i] + pz[i] * pz[i] + mass[i] * mass[i]);
+    rapidity[i] = 0.5 * std::log((e + pz[i]) / (e - pz[i]));
+  }
+}
+
+void PiddEdx::FillParticles() {
+  const auto &batch = batch_;
+  const auto beam_rapidity = data_header_->GetBeamRapidity();
+  const size_t n_probabilities = o_prob_field_ids_.size();
+  for (size_t i = 0; i < batch.i_track.size(); ++i) {
+    const int i_track = batch.i_track[i];
+    const auto &track = tracks_->GetChannel(i_track);
+
+    auto particle = rec_particles_pool_.Acquire(rec_particle_config_);
+    particle->SetMomentum3(track.GetMomentum3());
+    particle->SetPid(batch.pid[i]);
+    particle->SetField(int(track.GetId()), o_vtx_track_id_);
+
+    /* purity */
+    if (o_purity_mask_ >= 0)
+      particle->SetField(batch.purity_mask[i], o_purity_mask_);
+    for (size_t i_probability = 0; i_probability < n_probabilities; ++i_probability) {
+      SetFloatField(particle, batch.probabilities[i * n_probabilities + i_probability],
+                    o_prob_field_ids_[i_probability].second);
+    }
 
-      /* y_cm */
-      momentum.SetVectM(track.GetMomentum3(), mass);
-      particle->SetField<float>(momentum.Rapidity(), y_field_id_);
-      particle->SetField<float>(momentum.Rapidity() - data_header_->GetBeamRapidity(), y_cm_field_id_);
+    /* mass and y_cm */
+    particle->SetMass(batch.mass[i]);
+    SetFloatField(particle, batch.rapidity[i], y_field_id_);
+    SetFloatField(particle, batch.rapidity[i] - beam_rapidity, y_cm_field_id_);
 
+    if (copy_track_fields_) {
       /* dca_x, dca_y */
-      particle->SetField<float>(track.GetField<float>(i_dca_x_field_id_), o_dca_x_field_id_);
-      particle->SetField<float>(track.GetField<float>(i_dca_y_field_id_), o_dca_y_field_id_);
-      particle->SetField<float>(track.GetField<float>(i_chi2)/track.GetField<int>(i_ndf), o_chi2_ndf);
+      SetFloatField(particle, batch.dca_x[i_track], o_dca_x_field_id_);
+      SetFloatField(particle, batch.dca_y[i_track], o_dca_y_field_id_);
+      SetFloatField(particle, track.GetField<float>(i_chi2)/track.GetField<int>(i_ndf), o_chi2_ndf);
       /* nhits and ratio */
-      {
-        int nhits_total = track.GetField<int>(i_nhits_vtpc1_) +
-            track.GetField<int>(i_nhits_vtpc2_) +
-            track.GetField<int>(i_nhits_mtpc_);
-        int nhits_vtpc =
-            track.GetField<int>(i_nhits_vtpc1_) +
-                track.GetField<int>(i_nhits_vtpc2_);
-
-        int nhits_pot_total = track.GetField<int>(i_nhits_pot_vtpc1_) +
-            track.GetField<int>(i_nhits_pot_vtpc2_) +
-            track.GetField<int>(i_nhits_pot_mtpc_);
-        particle->SetField(nhits_total, o_nhits_total_);
-        particle->SetField<int>(nhits_vtpc, o_nhits_vtpc_);
-        particle->SetField(nhits_pot_total, o_nhits_pot_total_);
-        particle->SetField(float(nhits_total) / float(nhits_pot_total), o_nhits_ratio_);
-      }
+      const int nhits_total = batch.nhits_total[i_track];
+      const int nhits_pot_total = batch.nhits_pot_total[i_track];
+      particle->SetField(nhits_total, o_nhits_total_);
+      particle->SetField<int>(batch.nhits_vtpc[i_track], o_nhits_vtpc_);
+      particle->SetField(nhits_pot_total, o_nhits_pot_total_);
+      SetFloatField(particle, float(nhits_total) / float(nhits_pot_total), o_nhits_ratio_);
+    }
+  }
+}
 
+int PiddEdx::PreselectEvent() {
+  ++n_events_total_;
+
+  if (use_vtx_z_cut_) {
+    auto vtx_z = event_header_->GetVertexPosition3().Z();
+    if (!(vtx_z_min_ < vtx_z && vtx_z < vtx_z_max_)) {
+      ++n_events_rejected_;
+      return 0;
     }
+  }
+  if (!vtx_quality_field_name_.empty() &&
+      event_header_->GetField<int>(vtx_quality_field_id_) != vtx_quality_value_) {
+    ++n_events_rejected_;
+    return 0;
+  }
 
+  /* tracks branch is disabled, read explicitly */
+  auto tree = in_chain_->GetTree();
+  auto tracks_branch = tree->GetBranch(tracks_branch_.c_str());
+  if (!tracks_branch)
+    throw std::runtime_error("Branch '" + tracks_branch_ + "' is not found");
+  tracks_branch->GetEntry(tree->GetReadEntry(), 1);
+
+  int n_tracks = tracks_->GetNumberOfChannels();
+  if (n_tracks < min_multiplicity_) {
+    ++n_events_rejected_;
+    return 0;
   }
+  return n_tracks;
+}
 
-  std::cout << "Identified " << rec_particles_->GetNumberOfChannels() << " particles of " <<
-            tracks_->GetNumberOfChannels() << " tracks" << std::endl;
+void PiddEdx::UserFinish() {
+  if (sampler_.IsEnabled()) {
+    sampler_.Print(std::cout, GetName());
+    sampler_.Record(out_tree_->GetUserInfo(), GetName());
+  }
+  if (use_event_cuts_) {
+    std::cout << GetName() << ": rejected " << n_events_rejected_ << "/" << n_events_total_
+              << " events before PID" << std::endl;
+  }
+  if (track_cut_) {
+    std::cout << GetName() << ": rejected " << n_tracks_rejected_ << "/" << n_tracks_total_
+              << " tracks before PID" << std::endl;
+  }
+  if (count_allocations_)
+    allocation_stats_.Report(std::cout, GetName());
+  if (profile_scaling_) {
+    scaling_profile_.Report(std::cout, GetName());
+    scaling_profile_.Record(out_tree_->GetUserInfo(), GetName());
+  }
+}
+
+void PiddEdx::SetFloatField(AnalysisTree::Particle *particle, float value, short field_id) const {
+  /* field is not written in this output profile */
+  if (field_id < 0)
+    return;
+  particle->SetField(QuantizeFloat(value, o_float_precisions_[field_id]), field_id);
 }
 
 void PiddEdx::InitEfficiencyDefinitions() {
@@ -11,8 +11,19 @@
 #include <at_task/Task.h>
 #include <pid/Getter.h>
 #include <AnalysisTree/Detector.hpp>
+#include <AnalysisTree/EventHeader.hpp>
 
+#include <cstdint>
+#include <optional>
+#include <vector>
 
+#include "OutputProfile.hpp"
+#include "AllocationCounter.hpp"
+#include "ScalingProfile.hpp"
+#include "ChannelPool.hpp"
+#include "InputReadSet.hpp"
+#include "EventSampler.hpp"
+#include "VtxTrackCut.hpp"
 
 /**
  * @brief Takes dEdx PID from PID Getter
@@ -25,7 +36,7 @@ public:
  public:
   void UserInit(std::map<std::string, void *> &Map) override;
   void UserExec() override;
-  void UserFinish() override {}
+  void UserFinish() override;
   boost::program_options::options_description GetBoostOptions() override;
   void ProcessBoostVM(const boost::program_options::variables_map &vm) override;
   void PreInit() override;
@@ -34,6 +45,14 @@ public:
 
 private:
   void InitEfficiencyDefinitions();
+  /* returns number of tracks to process, 0 if event is rejected */
+  int PreselectEvent();
+  /* stages of UserExec, each one is a loop over the arrays of batch_ */
+  void EvalTrackHits(int n_tracks);
+  void IdentifyTracks(int n_tracks);
+  void EvalRapidities();
+  void FillParticles();
+  void SetFloatField(AnalysisTree::Particle *particle, float value, short field_id) const;
 
   /* SETUP */
   std::string getter_file_;
@@ -44,6 +63,53 @@ private:
 
   std::string output_branch_name_;
 
+  /* purity */
+  float purity_{0.9};
+  std::vector<float> purity_thresholds_;
+  std::vector<int> probability_pdgs_;
+
+  /* output schema */
+  std::string output_profile_name_;
+  std::vector<std::string> float_precision_definitions_;
+  OutputProfile output_profile_;
+  std::vector<float> o_float_precisions_;
+  bool copy_track_fields_{true};
+  bool prune_input_{false};
+
+  /* sampling */
+  unsigned int sample_every_{1};
+  Long64_t sample_events_{0};
+  uint64_t sample_seed_{0};
+  std::string sample_event_id_;
+  bool use_sampling_{false};
+  EventSampler sampler_;
+
+  /* pre-selection */
+  bool use_track_cut_{false};
+  float track_cut_dcax_max_{VtxTrackCut::Standard().dcax_max};
+  float track_cut_dcay_max_{VtxTrackCut::Standard().dcay_max};
+  int track_cut_nhits_vtpc_min_{VtxTrackCut::Standard().nhits_vtpc_min};
+  int track_cut_nhits_total_min_{VtxTrackCut::Standard().nhits_total_min};
+  double track_cut_nhits_ratio_min_{VtxTrackCut::Standard().ratio_nhits_nhits_pot_min};
+  double track_cut_nhits_ratio_max_{VtxTrackCut::Standard().ratio_nhits_nhits_pot_max};
+  std::optional<VtxTrackCut> track_cut_;
+
+  bool use_event_cuts_{false};
+  bool use_vtx_z_cut_{false};
+  std::string event_header_branch_;
+  float vtx_z_min_{0.};
+  float vtx_z_max_{0.};
+  std::string vtx_quality_field_name_;
+  int vtx_quality_value_{0};
+  int min_multiplicity_{0};
+  AnalysisTree::EventHeader *event_header_{nullptr};
+  short vtx_quality_field_id_{-1};
+
+  size_t n_events_total_{0};
+  size_t n_events_rejected_{0};
+  size_t n_tracks_total_{0};
+  size_t n_tracks_rejected_{0};
+
   /* efficiency */
   std::vector<std::string> efficiency_definitions_;
   std::string efficiency_matrix_name_{"vtx_sim_centr_y_pt"};
@@ -52,9 +118,6 @@ private:
   struct Efficiency;
   std::map<int, std::unique_ptr<Efficiency>> efficiencies_;
 
-
-
-
   std::shared_ptr<Pid::BaseGetter> getter_;
 
   AnalysisTree::TrackDetector *tracks_{nullptr};
@@ -62,19 +125,50 @@ private:
   short charge_field_id_{-1};
 
   AnalysisTree::Particles *rec_particles_{nullptr};
+  ChannelPool<AnalysisTree::Particle> rec_particles_pool_;
+
+  /* tracks of the event in contiguous arrays, the buffers are reused from event to event */
+  struct TrackBatch {
+    /* all tracks, filled if the track cut or copy-track-fields is on */
+    std::vector<int> nhits_vtpc;
+    std::vector<int> nhits_total;
+    std::vector<int> nhits_pot_total;
+    std::vector<float> dca_x;
+    std::vector<float> dca_y;
+    /* result of the track cut, filled if it is on */
+    std::vector<uint8_t> passed;
+    /* identified particles */
+    std::vector<int> i_track;
+    std::vector<int> pid;
+    std::vector<int> purity_mask;
+    /* o_prob_field_ids_.size() values per particle */
+    std::vector<float> probabilities;
+    std::vector<double> px;
+    std::vector<double> py;
+    std::vector<double> pz;
+    std::vector<double> mass;
+    std::vector<double> rapidity;
+  };
+  TrackBatch batch_;
+
+  bool count_allocations_{false};
+  AllocationStats allocation_stats_;
+  bool profile_scaling_{false};
+  size_t profile_scaling_max_tracks_{10000};
+  ScalingProfile scaling_profile_;
 
   AnalysisTree::BranchConfig rec_particle_config_;
-  short y_cm_field_id_;
-  short o_dca_x_field_id_;
-  short o_dca_y_field_id_;
+  short y_cm_field_id_{-1};
+  short o_dca_x_field_id_{-1};
+  short o_dca_y_field_id_{-1};
   short i_dca_y_field_id_;
   short i_dca_x_field_id_;
   short i_chi2;
   short i_ndf;
-  short o_chi2_ndf;
+  short o_chi2_ndf{-1};
   short o_nhits_total_;
   short o_nhits_pot_total_;
-  short o_nhits_ratio_;
+  short o_nhits_ratio_{-1};
   short o_nhits_vtpc_;
   short i_nhits_mtpc_;
   short i_nhits_vtpc2_;
@@ -83,10 +177,11 @@ private:
   short i_nhits_pot_vtpc2_;
   short i_nhits_pot_vtpc1_;
 
-  short y_field_id_;
+  short y_field_id_{-1};
+  short o_purity_mask_{-1};
+  short o_vtx_track_id_{-1};
+  std::vector<std::pair<int, short>> o_prob_field_ids_;
 TASK_DEF(PiddEdx, 0)
-
-
 };
 
 #endif //ATPIDTASK_PID_DEDX_PIDDEDX_H
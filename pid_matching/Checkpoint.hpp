@@ -0,0 +1,100 @@
+//
+// Created by eugene on 02/04/2021.
+//
+
+#ifndef ATPIDTASK_PID_MATCHING_CHECKPOINT_HPP_
+#define ATPIDTASK_PID_MATCHING_CHECKPOINT_HPP_
+
+#include <TFile.h>
+#include <TDirectory.h>
+#include <TParameter.h>
+#include <TROOT.h>
+
+#include <chrono>
+#include <cstdio>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Writes snapshots of the accumulators to a side file in background.
+ *
+ * Objects are copied in the calling thread, the file is written by a separate
+ * thread to '<path>.tmp' and renamed, thus the checkpoint on the disk is always
+ * complete. A new snapshot is not accepted while the previous one is being
+ * written, the event loop never waits for the I/O.
+ */
+class CheckpointWriter {
+ public:
+  /* '<directory>/<name>' and the copy of the object */
+  using Snapshot = std::vector<std::pair<std::string, std::unique_ptr<TObject>>>;
+
+  explicit CheckpointWriter(std::string path) : path_(std::move(path)) {
+    ROOT::EnableThreadSafety();
+  }
+
+  ~CheckpointWriter() {
+    Wait();
+  }
+
+  const std::string &GetPath() const { return path_; }
+
+  bool IsBusy() const {
+    return pending_.valid() && pending_.wait_for(std::chrono::seconds(0)) != std::future_status::ready;
+  }
+
+  /* false if the previous checkpoint is still being written */
+  bool Submit(Snapshot snapshot, Long64_t next_entry, Long64_t n_events) {
+    if (IsBusy())
+      return false;
+    Wait();
+    pending_ = std::async(std::launch::async,
+                          [path = path_, snapshot = std::move(snapshot), next_entry, n_events]() {
+                            Write(path, snapshot, next_entry, n_events);
+                          });
+    return true;
+  }
+
+  void Wait() {
+    if (!pending_.valid())
+      return;
+    try {
+      pending_.get();
+    } catch (std::exception &e) {
+      std::cout << "Checkpoint: WARNING: unable to write '" << path_ << "': " << e.what() << std::endl;
+    }
+  }
+
+  static void Write(const std::string &path, const Snapshot &snapshot, Long64_t next_entry, Long64_t n_events) {
+    const auto tmp_path = path + ".tmp";
+    {
+      TFile file(tmp_path.c_str(), "RECREATE");
+      if (!file.IsOpen())
+        throw std::runtime_error("unable to open '" + tmp_path + "'");
+      for (auto &&[object_path, object] : snapshot) {
+        auto slash_pos = object_path.rfind('/');
+        TDirectory *dir = &file;
+        if (slash_pos != std::string::npos)
+          dir = file.mkdir(object_path.substr(0, slash_pos).c_str(), "", true);
+        dir->WriteTObject(object.get(), object_path.substr(slash_pos + 1).c_str());
+      }
+      TParameter<Long64_t> next_entry_par("next_entry", next_entry);
+      TParameter<Long64_t> n_events_par("n_events", n_events);
+      file.WriteTObject(&next_entry_par);
+      file.WriteTObject(&n_events_par);
+      file.Close();
+    }
+    if (std::rename(tmp_path.c_str(), path.c_str()) != 0)
+      throw std::runtime_error("unable to rename '" + tmp_path + "'");
+  }
+
+ private:
+  std::string path_;
+  std::future<void> pending_;
+};
+
+#endif //ATPIDTASK_PID_MATCHING_CHECKPOINT_HPP_
@@ -0,0 +1,243 @@
+//
+// Created by eugene on 14/04/2021.
+//
+
+#include <boost/program_options.hpp>
+
+#include <TFile.h>
+#include <TEfficiency.h>
+#include <TH2.h>
+#include <TKey.h>
+#include <TNamed.h>
+
+#include <iostream>
+#include <map>
+#include <memory>
+#include <regex>
+#include <utility>
+#include <vector>
+
+#include "AxisSpec.hpp"
+#include "FlatCache.hpp"
+#include "PidMatchingCuts.hpp"
+
+namespace {
+
+struct CandidateSpecies {
+  std::unique_ptr<TEfficiency> efficiency_msim_sim_y_pt;
+  std::unique_ptr<TEfficiency> efficiency_vtx_sim_y_pt;
+  std::unique_ptr<TH2D> vtx_tracks_y_pt_wmsim_sim;
+  std::unique_ptr<TH2D> vtx_tracks_y_pt_wvtx_sim;
+};
+
+/* same weight as in the validation of PidMatching */
+double ClosureWeight(const TEfficiency &efficiency, double y_cm, double pt) {
+  auto weight = 1. / efficiency.GetEfficiency(efficiency.FindFixBin(y_cm, pt));
+  return (weight < 100) ? weight : 0.;
+}
+
+}
+
+/**
+ * @brief Closure test of the candidate efficiency files (same as --validate-file of PidMatching)
+ * replayed from the flat cache of the PidMatching output instead of rerunning the matching.
+ *
+ * Columns of the cache (see FlatCacheExtract):
+ *   RecParticles:pid/I,y_cm,pT[,nhits_vtpc1/I,nhits_vtpc2/I,nhits_mtpc/I,
+ *                nhits_pot_vtpc1/I,nhits_pot_vtpc2/I,nhits_pot_mtpc/I,dcax,dcay]
+ *   SimTracksProc:pdg/I,mother_id/I,y_cm,pT
+ * Track quality columns are needed only for --vtx-cut standard.
+ */
+int main(int argc, char **argv) {
+  namespace po = boost::program_options;
+
+  std::string flat_cache_file;
+  std::vector<std::string> efficiency_files;
+  std::string output_file;
+  std::string vtx_cut_name;
+  std::string y_axis_definition;
+  std::string pt_axis_definition;
+
+  po::options_description desc("ClosureReplay options");
+  desc.add_options()
+      ("help,h", "Print help")
+      ("flat-cache,i", po::value(&flat_cache_file)->required(), "Flat cache of the PidMatching output")
+      ("efficiency-files,e", po::value(&efficiency_files)->multitoken()->required(),
+       "Candidate efficiency files, all are tested in one pass")
+      ("output,o", po::value(&output_file)->default_value("closure.root"), "Output file")
+      ("vtx-cut", po::value(&vtx_cut_name)->default_value("none"),
+       "Selection of vtx tracks: 'none' (PidMatching_NoCuts) or 'standard' (PidMatching_StandardCuts)")
+      ("y-axis", po::value(&y_axis_definition)->default_value("120:-2:4"), "Rapidity (CM) axis, <nbins>:<lo>:<hi>")
+      ("pt-axis", po::value(&pt_axis_definition)->default_value("60:0:3"), "pT axis, <nbins>:<lo>:<hi>");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if (vm.count("help")) {
+      std::cout << desc << std::endl;
+      return 0;
+    }
+    po::notify(vm);
+    if (vtx_cut_name != "none" && vtx_cut_name != "standard")
+      throw std::runtime_error("Unknown --vtx-cut '" + vtx_cut_name + "'");
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl << desc << std::endl;
+    return 1;
+  }
+
+  const auto y_axis = AxisSpec::Parse(y_axis_definition);
+  const auto pt_axis = AxisSpec::Parse(pt_axis_definition);
+  const auto y_edges = y_axis.Edges();
+  const auto pt_edges = pt_axis.Edges();
+  TH1::AddDirectory(false);
+
+  /* candidates */
+  std::vector<std::map<int, CandidateSpecies>> candidates(efficiency_files.size());
+  for (size_t i_candidate = 0; i_candidate < efficiency_files.size(); ++i_candidate) {
+    TFile input_file(efficiency_files[i_candidate].c_str(), "READ");
+    if (!input_file.IsOpen())
+      throw std::runtime_error("Unable to open '" + efficiency_files[i_candidate] + "'");
+    /* species are all 'efficiency_<pdg>' directories, same as in EvalEfficiency */
+    const std::regex re_efficiency_dir("^efficiency_(-?\\d+)$");
+    std::smatch match_results;
+    std::vector<int> pdgs;
+    for (auto key_object : *input_file.GetListOfKeys()) {
+      std::string dir_name(key_object->GetName());
+      if (std::regex_match(dir_name, match_results, re_efficiency_dir))
+        pdgs.push_back(std::stoi(match_results.str(1)));
+    }
+    for (auto pdg : pdgs) {
+      auto msim_sim = dynamic_cast<TEfficiency *>(input_file.Get(Form("efficiency_%d/matched_sim_sim_y_pt", pdg)));
+      auto vtx_sim = dynamic_cast<TEfficiency *>(input_file.Get(Form("efficiency_%d/vtx_sim_y_pt", pdg)));
+      if (!msim_sim || !vtx_sim)
+        continue;
+      auto &species = candidates[i_candidate][pdg];
+      msim_sim->SetDirectory(nullptr);
+      vtx_sim->SetDirectory(nullptr);
+      species.efficiency_msim_sim_y_pt.reset(msim_sim);
+      species.efficiency_vtx_sim_y_pt.reset(vtx_sim);
+      species.vtx_tracks_y_pt_wmsim_sim = std::make_unique<TH2D>("vtx_tracks_y_pt_wmsim_sim",
+                                                                 "Vtx tracks (efficiency weighted);#it{y}_{CM};p_{T} (GeV/c)",
+                                                                 y_axis.n_bins, y_edges.data(),
+                                                                 pt_axis.n_bins, pt_edges.data());
+      species.vtx_tracks_y_pt_wvtx_sim.reset(
+          (TH2D *) species.vtx_tracks_y_pt_wmsim_sim->Clone("vtx_tracks_y_pt_wvtx_sim"));
+    }
+    if (candidates[i_candidate].empty())
+      throw std::runtime_error("No efficiencies in '" + efficiency_files[i_candidate] + "'");
+  }
+
+  /* sim yields do not depend on the candidate */
+  std::map<int, std::unique_ptr<TH2D>> sim_tracks_y_pt;
+  for (auto &candidate : candidates) {
+    for (auto &&[pdg, species] : candidate) {
+      if (sim_tracks_y_pt.count(pdg))
+        continue;
+      sim_tracks_y_pt[pdg] = std::make_unique<TH2D>("sim_tracks_y_pt",
+                                                    "Sim tracks (primary);#it{y}_{CM};p_{T} (GeV/c)",
+                                                    y_axis.n_bins, y_edges.data(),
+                                                    pt_axis.n_bins, pt_edges.data());
+    }
+  }
+
+  FlatCache::Reader cache(flat_cache_file);
+  cache.Print();
+
+  /* vtx tracks */
+  {
+    const auto rec_branch = cache.FindBranch("RecParticles");
+    if (rec_branch < 0)
+      throw std::runtime_error("No RecParticles in the flat cache");
+    const auto n_rec = cache.GetOffsets(rec_branch)[cache.GetNEvents()];
+    const auto pid = cache.GetColumn<int32_t>("RecParticles", "pid");
+    const auto y_cm = cache.GetColumn<float>("RecParticles", "y_cm");
+    const auto pt = cache.GetColumn<float>("RecParticles", "pT");
+
+    std::vector<char> is_good(n_rec, 1);
+    if (vtx_cut_name == "standard") {
+      const StandardCutsPolicy standard_cuts;
+      const auto &cut = standard_cuts.vtx_track_cut;
+      const auto nhits_vtpc1 = cache.GetColumn<int32_t>("RecParticles", "nhits_vtpc1");
+      const auto nhits_vtpc2 = cache.GetColumn<int32_t>("RecParticles", "nhits_vtpc2");
+      const auto nhits_mtpc = cache.GetColumn<int32_t>("RecParticles", "nhits_mtpc");
+      const auto nhits_pot_vtpc1 = cache.GetColumn<int32_t>("RecParticles", "nhits_pot_vtpc1");
+      const auto nhits_pot_vtpc2 = cache.GetColumn<int32_t>("RecParticles", "nhits_pot_vtpc2");
+      const auto nhits_pot_mtpc = cache.GetColumn<int32_t>("RecParticles", "nhits_pot_mtpc");
+      const auto dca_x = cache.GetColumn<float>("RecParticles", "dcax");
+      const auto dca_y = cache.GetColumn<float>("RecParticles", "dcay");
+      for (uint64_t i = 0; i < n_rec; ++i) {
+        const int nhits_vtpc = nhits_vtpc1[i] + nhits_vtpc2[i];
+        is_good[i] = cut.CheckValues(nhits_vtpc + nhits_mtpc[i], nhits_vtpc,
+                                     nhits_pot_vtpc1[i] + nhits_pot_vtpc2[i] + nhits_pot_mtpc[i],
+                                     dca_x[i], dca_y[i]);
+      }
+    }
+
+    for (uint64_t i = 0; i < n_rec; ++i) {
+      if (!is_good[i])
+        continue;
+      for (auto &candidate : candidates) {
+        auto species_it = candidate.find(pid[i]);
+        if (species_it == candidate.end())
+          continue;
+        auto &species = species_it->second;
+        species.vtx_tracks_y_pt_wmsim_sim->Fill(y_cm[i], pt[i],
+                                                ClosureWeight(*species.efficiency_msim_sim_y_pt, y_cm[i], pt[i]));
+        species.vtx_tracks_y_pt_wvtx_sim->Fill(y_cm[i], pt[i],
+                                               ClosureWeight(*species.efficiency_vtx_sim_y_pt, y_cm[i], pt[i]));
+      }
+    }
+    std::cout << "Replayed " << n_rec << " vtx tracks" << std::endl;
+  }
+
+  /* primary sim tracks */
+  {
+    const auto sim_branch = cache.FindBranch("SimTracksProc");
+    if (sim_branch < 0)
+      throw std::runtime_error("No SimTracksProc in the flat cache");
+    const auto n_sim = cache.GetOffsets(sim_branch)[cache.GetNEvents()];
+    const auto pdg = cache.GetColumn<int32_t>("SimTracksProc", "pdg");
+    const auto mother_id = cache.GetColumn<int32_t>("SimTracksProc", "mother_id");
+    const auto y_cm = cache.GetColumn<float>("SimTracksProc", "y_cm");
+    const auto pt = cache.GetColumn<float>("SimTracksProc", "pT");
+    for (uint64_t i = 0; i < n_sim; ++i) {
+      if (mother_id[i] != -1)
+        continue;
+      auto histo_it = sim_tracks_y_pt.find(pdg[i]);
+      if (histo_it != sim_tracks_y_pt.end())
+        histo_it->second->Fill(y_cm[i], pt[i]);
+    }
+    std::cout << "Replayed " << n_sim << " sim tracks" << std::endl;
+  }
+
+  /* output, same objects as in validated_eff_<pdg> of PidMatching */
+  TFile output(output_file.c_str(), "RECREATE");
+  for (size_t i_candidate = 0; i_candidate < candidates.size(); ++i_candidate) {
+    auto candidate_dir = output.mkdir(Form("candidate_%zu", i_candidate));
+    TNamed source("source", efficiency_files[i_candidate].c_str());
+    candidate_dir->WriteTObject(&source);
+
+    for (auto &&[pdg, species] : candidates[i_candidate]) {
+      auto dir = candidate_dir->mkdir(Form("validated_eff_%d", pdg));
+      auto &sim_tracks = sim_tracks_y_pt.at(pdg);
+      dir->WriteTObject(species.vtx_tracks_y_pt_wmsim_sim.get());
+      dir->WriteTObject(species.vtx_tracks_y_pt_wvtx_sim.get());
+      dir->WriteTObject(sim_tracks.get());
+
+      const std::vector<std::pair<const char *, TH2 *>> ratios{
+          {"vtx_sim_y_pt_wmsim_sim", species.vtx_tracks_y_pt_wmsim_sim.get()},
+          {"vtx_sim_y_pt_wvtx_sim", species.vtx_tracks_y_pt_wvtx_sim.get()},
+      };
+      for (auto &&[ratio_name, weighted] : ratios) {
+        std::unique_ptr<TH2> ratio((TH2 *) weighted->Clone(ratio_name));
+        ratio->Divide(sim_tracks.get());
+        ratio->SetTitle("N(Weighted VtxTracks) / N (Primary Sim Tracks)");
+        ratio->SetMinimum(0.9);
+        ratio->SetMaximum(1.1);
+        dir->WriteTObject(ratio.get());
+      }
+    }
+  }
+  output.Close();
+  return 0;
+}
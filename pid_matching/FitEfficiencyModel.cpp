@@ -0,0 +1,211 @@
+//
+// Created by eugene on 12/04/2021.
+//
+
+#include <boost/program_options.hpp>
+
+#include <TFile.h>
+#include <TKey.h>
+#include <TEfficiency.h>
+#include <TH1.h>
+#include <TMatrixD.h>
+#include <TParameter.h>
+#include <TDecompSVD.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <regex>
+
+#include "EfficiencyModel.hpp"
+
+namespace {
+
+struct FitResult {
+  EfficiencyModel model;
+  double chi2_ndf{0.};
+};
+
+bool IsUniform(const TAxis &axis, int first_bin, int last_bin) {
+  const double width = axis.GetBinWidth(first_bin);
+  for (int i = first_bin + 1; i <= last_bin; ++i) {
+    if (std::abs(axis.GetBinWidth(i) - width) > 1e-6 * width)
+      return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Weighted least squares fit of the model to the bins of 2D efficiency.
+ * Bin weight is the inverse binomial variance, regularized for eps = 0 and eps = 1.
+ * The bins used in the fit are stored in the mask of the model, one cell per bin.
+ * Throws if the efficiency is not populated enough for the fit.
+ */
+FitResult FitModel(const TEfficiency &efficiency, int degree_y, int degree_pt, double min_total) {
+  auto total = efficiency.GetTotalHistogram();
+  auto passed = efficiency.GetPassedHistogram();
+  auto x_axis = total->GetXaxis();
+  auto y_axis = total->GetYaxis();
+
+  /* fit range is the bounding box of the populated bins */
+  int ix_lo = std::numeric_limits<int>::max(), ix_hi = 0;
+  int iy_lo = std::numeric_limits<int>::max(), iy_hi = 0;
+  for (int ix = 1; ix <= x_axis->GetNbins(); ++ix) {
+    for (int iy = 1; iy <= y_axis->GetNbins(); ++iy) {
+      if (total->GetBinContent(ix, iy) < min_total)
+        continue;
+      ix_lo = std::min(ix_lo, ix);
+      ix_hi = std::max(ix_hi, ix);
+      iy_lo = std::min(iy_lo, iy);
+      iy_hi = std::max(iy_hi, iy);
+    }
+  }
+  if (ix_hi == 0)
+    throw std::runtime_error(std::string("No populated bins in ") + efficiency.GetName());
+  if (!IsUniform(*x_axis, ix_lo, ix_hi) || !IsUniform(*y_axis, iy_lo, iy_hi))
+    throw std::runtime_error(std::string("Non-uniform binning of ") + efficiency.GetName());
+
+  EfficiencyModel model(degree_y, degree_pt,
+                        x_axis->GetBinLowEdge(ix_lo), x_axis->GetBinUpEdge(ix_hi),
+                        y_axis->GetBinLowEdge(iy_lo), y_axis->GetBinUpEdge(iy_hi));
+  model.InitMask(ix_hi - ix_lo + 1, iy_hi - iy_lo + 1);
+  const int n_par = int(model.GetNCoefficients());
+  TMatrixD normal(n_par, n_par);
+  TVectorD rhs(n_par);
+  std::vector<double> basis(n_par);
+
+  int n_bins = 0;
+  for (int ix = 1; ix <= x_axis->GetNbins(); ++ix) {
+    for (int iy = 1; iy <= y_axis->GetNbins(); ++iy) {
+      const double n = total->GetBinContent(ix, iy);
+      if (n < min_total)
+        continue;
+      const double eps = std::min(passed->GetBinContent(ix, iy), n) / n;
+      const double weight = n / std::max(eps * (1. - eps), 1. / n);
+      model.Basis(x_axis->GetBinCenter(ix), y_axis->GetBinCenter(iy), basis.data());
+      model.SetFitted(x_axis->GetBinCenter(ix), y_axis->GetBinCenter(iy));
+      for (int i = 0; i < n_par; ++i) {
+        rhs[i] += weight * basis[i] * eps;
+        for (int j = 0; j < n_par; ++j) {
+          normal(i, j) += weight * basis[i] * basis[j];
+        }
+      }
+      ++n_bins;
+    }
+  }
+  if (n_bins <= n_par)
+    throw std::runtime_error(std::string("Not enough populated bins to fit ") + efficiency.GetName());
+
+  TDecompSVD svd(normal);
+  bool ok = false;
+  auto solution = svd.Solve(rhs, ok);
+  if (!ok)
+    throw std::runtime_error(std::string("Fit of ") + efficiency.GetName() + " failed");
+  std::copy(solution.GetMatrixArray(), solution.GetMatrixArray() + n_par, model.Coefficients().begin());
+
+  FitResult result;
+
+  /* goodness of the fit */
+  double chi2 = 0.;
+  for (int ix = 1; ix <= x_axis->GetNbins(); ++ix) {
+    for (int iy = 1; iy <= y_axis->GetNbins(); ++iy) {
+      const double n = total->GetBinContent(ix, iy);
+      if (n < min_total)
+        continue;
+      const double eps = std::min(passed->GetBinContent(ix, iy), n) / n;
+      const double residual = model.Eval(float(x_axis->GetBinCenter(ix)), float(y_axis->GetBinCenter(iy))) - eps;
+      chi2 += residual * residual * n / std::max(eps * (1. - eps), 1. / n);
+    }
+  }
+  result.model = model;
+  result.chi2_ndf = chi2 / (n_bins - n_par);
+  std::cout << efficiency.GetName() << ": " << n_bins << " bins, chi2/ndf = " << result.chi2_ndf << std::endl;
+  return result;
+}
+
+}
+
+/**
+ * @brief Fits 2D efficiencies of the PidMatching output with EfficiencyModel,
+ * the coefficients together with the mask of the bins used in the fit are
+ * written next to the efficiency as '<name>_model' and the fit quality as
+ * '<name>_model_chi2ndf'. Species which can not be fitted are skipped and
+ * their previous models removed.
+ */
+int main(int argc, char **argv) {
+  namespace po = boost::program_options;
+
+  std::string file_name;
+  std::string efficiency_name;
+  int degree_y{4};
+  int degree_pt{4};
+  double min_total{5.};
+
+  po::options_description desc("FitEfficiencyModel options");
+  desc.add_options()
+      ("help,h", "Print help")
+      ("input,i", po::value(&file_name)->required(), "PidMatching QA file, updated in place")
+      ("efficiency", po::value(&efficiency_name)->default_value("vtx_sim_y_pt"), "2D efficiency (y_cm, pT) to fit")
+      ("degree-y", po::value(&degree_y)->default_value(4), "Degree of the polynomial in y_cm")
+      ("degree-pt", po::value(&degree_pt)->default_value(4), "Degree of the polynomial in pT")
+      ("min-total", po::value(&min_total)->default_value(5.), "Minimal number of entries of the bin used in the fit");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if (vm.count("help")) {
+      std::cout << desc << std::endl;
+      return 0;
+    }
+    po::notify(vm);
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl << desc << std::endl;
+    return 1;
+  }
+
+  TFile file(file_name.c_str(), "UPDATE");
+  if (!file.IsOpen())
+    throw std::runtime_error("Unable to open '" + file_name + "'");
+
+  const std::regex re_efficiency_dir("^efficiency_(-?\\d+)$");
+  std::vector<std::string> dir_names;
+  for (auto key_object : *file.GetListOfKeys()) {
+    std::string dir_name(key_object->GetName());
+    if (std::regex_match(dir_name, re_efficiency_dir))
+      dir_names.push_back(dir_name);
+  }
+
+  const auto model_name = efficiency_name + "_model";
+  size_t n_skipped = 0;
+  for (auto &dir_name : dir_names) {
+    auto dir = file.GetDirectory(dir_name.c_str());
+    auto efficiency = dynamic_cast<TEfficiency *>(dir->Get(efficiency_name.c_str()));
+    if (!efficiency || efficiency->GetDimension() != 2) {
+      std::cout << dir_name << ": no 2D efficiency '" << efficiency_name << "', skipping" << std::endl;
+      continue;
+    }
+    FitResult result;
+    try {
+      result = FitModel(*efficiency, degree_y, degree_pt, min_total);
+    } catch (std::runtime_error &e) {
+      std::cout << dir_name << ": " << e.what() << ", skipping" << std::endl;
+      /* a model of the earlier fit would not match the efficiency */
+      for (auto &&suffix : {"", "_mask", "_chi2ndf"}) {
+        dir->Delete((model_name + suffix + ";*").c_str());
+      }
+      ++n_skipped;
+      continue;
+    }
+    auto model_vector = result.model.ToVector();
+    TParameter<Double_t> chi2_ndf((model_name + "_chi2ndf").c_str(), result.chi2_ndf);
+    dir->WriteObject(&model_vector, model_name.c_str(), "Overwrite");
+    dir->WriteTObject(&chi2_ndf, chi2_ndf.GetName(), "Overwrite");
+    /* written by the earlier versions, the mask is a part of the model now */
+    dir->Delete((model_name + "_mask;*").c_str());
+  }
+  file.Close();
+  if (n_skipped > 0)
+    std::cout << n_skipped << " of " << dir_names.size() << " species are not fitted" << std::endl;
+  return 0;
+}
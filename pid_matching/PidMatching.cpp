@@ -19,16 +19,59 @@
 
 #include "TEfficiencyHelper.hpp"
 #include "PlotEfficiencies.hpp"
+#include "SparseCounterMap.hpp"
 
-#include "VtxTrackCut.hpp"
+#include "OutputProfile.hpp"
+#include "AllocationCounter.hpp"
+#include "InputReadSet.hpp"
+#include <TChain.h>
+#include <TObjString.h>
+#include <TParameter.h>
+
+#include <algorithm>
+#include <limits>
 
 bool PidMatching::opts_loaded = false;
 std::string PidMatching::qa_file_name = "efficiency.root";
 bool PidMatching::save_canvases = false;
 std::string PidMatching::validate_file = "";
-
-TASK_IMPL(PidMatching_NoCuts)
-TASK_IMPL(PidMatching_StandardCuts)
+std::string PidMatching::output_profile_name = "full";
+std::vector<std::string> PidMatching::float_precision_definitions = {};
+bool PidMatching::count_allocations = false;
+bool PidMatching::profile_scaling = false;
+size_t PidMatching::profile_scaling_max_tracks = 10000;
+unsigned int PidMatching::event_threads = 1;
+unsigned int PidMatching::event_chunk_size = 256;
+std::unique_ptr<ChunkPool> PidMatching::event_pool;
+bool PidMatching::prune_input = false;
+unsigned int PidMatching::plot_threads = 0;
+bool PidMatching::sparse_centrality_maps = false;
+std::vector<int> PidMatching::species = {211, -211, 2212};
+std::string PidMatching::mult_axis_definition = "6:0:300";
+std::string PidMatching::y_axis_definition = "120:-2:4";
+std::string PidMatching::eta_axis_definition = "120:0:6";
+std::string PidMatching::pt_axis_definition = "60:0:3";
+double PidMatching::memory_budget_mb = 0.;
+double PidMatching::convergence_precision = 0.;
+double PidMatching::convergence_fraction = 0.9;
+unsigned int PidMatching::convergence_check_interval = 1000;
+unsigned int PidMatching::sample_every = 1;
+Long64_t PidMatching::sample_events = 0;
+uint64_t PidMatching::sample_seed = 0;
+std::string PidMatching::sample_event_id = "RecEventHeader.evt_id";
+unsigned int PidMatching::checkpoint_interval = 0;
+std::string PidMatching::checkpoint_prefix = "pid_matching_checkpoint";
+bool PidMatching::resume = false;
+std::string PidMatching::sim_tracks_proc_mode = "all";
+std::vector<int> PidMatching::sim_tracks_proc_species = {};
+int PidMatching::n_instances = 0;
+int PidMatching::n_converged_instances = 0;
+bool PidMatching::output_stopped = false;
+bool PidMatching::output_cut = false;
+Long64_t PidMatching::output_begin_entry = std::numeric_limits<Long64_t>::max();
+bool PidMatching::output_suspended = false;
+std::set<std::string> PidMatching::output_branch_names = {};
+Long64_t PidMatching::n_output_entries = 0;
 
 using std::cout;
 using std::endl;
@@ -52,6 +95,10 @@ struct PidMatching::PidEfficiencyQAStruct {
 
   TEfficiency *matched_vtx_primary_y_pt{nullptr};
 
+  /* sparse replacements of the centrality-differential maps, densified in UserFinish */
+  std::unique_ptr<SparseCounterMap> tracks_centr_y_pt_sparse; /* 0 - matched tracks, 1 - sim tracks */
+  std::unique_ptr<SparseCounterMap> matched_sim_sim_centr_y_pt_sparse;
+
 };
 
 struct PidMatching::ValidateEfficiencyStruct {
@@ -87,8 +134,74 @@ boost::program_options::options_description PidMatching::GetBoostOptions() {
     po::options_description desc;
     desc.add_options()
         ("save-canvases", po::value(&save_canvases)->default_value(false), "Save canvases")
+        ("sparse-centrality-maps", po::value(&sparse_centrality_maps)->default_value(false),
+         "Accumulate centrality-differential maps in sparse storage, dense objects are created on write")
+        ("species", po::value(&species)->multitoken()->default_value({211, -211, 2212}, "211 -211 2212"),
+         "PDG codes of the species to evaluate efficiencies for")
+        ("mult-axis", po::value(&mult_axis_definition)->default_value("6:0:300"),
+         "Multiplicity axis of the QA histograms, <nbins>:<lo>:<hi>")
+        ("y-axis", po::value(&y_axis_definition)->default_value("120:-2:4"),
+         "Rapidity (CM) axis of the QA histograms, <nbins>:<lo>:<hi>")
+        ("eta-axis", po::value(&eta_axis_definition)->default_value("120:0:6"),
+         "Pseudorapidity axis of the QA histograms, <nbins>:<lo>:<hi>")
+        ("pt-axis", po::value(&pt_axis_definition)->default_value("60:0:3"),
+         "Transverse momentum axis of the QA histograms, <nbins>:<lo>:<hi>")
+        ("memory-budget-mb", po::value(&memory_budget_mb)->default_value(0.),
+         "Refuse to run if the estimated memory of the QA histograms, with --checkpoint-interval including "
+         "the checkpoint snapshot, exceeds this value (0 - no limit)")
+        ("convergence-precision", po::value(&convergence_precision)->default_value(0.),
+         "Stop accounting once the relative uncertainty of vtx_sim_y_pt and matched_sim_sim_y_pt "
+         "is below this value in --convergence-fraction of populated bins (0 - process all events). "
+         "The output tree ends at the event where all tasks converged (if other tasks write into it, "
+         "PidMatching branches are empty from then on) and the input read only by PidMatching is not read")
+        ("convergence-fraction", po::value(&convergence_fraction)->default_value(0.9),
+         "Fraction of populated bins which must reach --convergence-precision")
+        ("convergence-check-interval", po::value(&convergence_check_interval)->default_value(1000),
+         "Number of events between convergence checks")
+        ("sample-every", po::value(&sample_every)->default_value(1),
+         "Process 1 in N events, selected deterministically by the hash of the event id. "
+         "Unselected events have empty output and the '<task>_sampled' flag unset")
+        ("sample-events", po::value(&sample_events)->default_value(0),
+         "Process approximately this number of events (overrides --sample-every)")
+        ("sample-seed", po::value(&sample_seed)->default_value(0), "Seed of the event sampling")
+        ("sample-event-id", po::value(&sample_event_id)->default_value("RecEventHeader.evt_id"),
+         "Integer field identifying the event for the sampling, <branch>.<field>")
+        ("checkpoint-interval", po::value(&checkpoint_interval)->default_value(0),
+         "Write raw QA counters and the input position every N events (0 - no checkpoints)")
+        ("checkpoint-prefix", po::value(&checkpoint_prefix)->default_value("pid_matching_checkpoint"),
+         "Checkpoint is written to <prefix>_<task name>.root")
+        ("resume", po::value(&resume)->default_value(false),
+         "Continue from the checkpoint of the same input files. Entries accounted in the checkpoints of all "
+         "instances are skipped, the output tree starts at the earliest checkpoint of the instances "
+         "(see 'PidMatching_first_input_entry' in its user info) and is merged with the entries before it "
+         "from the output of the interrupted run")
+        ("sim-tracks-proc", po::value(&sim_tracks_proc_mode)->default_value("all"),
+         "SimTracksProc output: 'all', 'none', 'primary' (passing the sim track selection of the task) "
+         "or 'species' (see --sim-tracks-proc-species). Unless 'all', SimTracksProc is a subset of SimTracks "
+         "and its mother_id (as sim_mother_id of the matched tracks) still indexes SimTracks, "
+         "the mothers may be absent in SimTracksProc")
+        ("sim-tracks-proc-species", po::value(&sim_tracks_proc_species)->multitoken(),
+         "PDG codes of SimTracksProc in 'species' mode (default: --species)")
+        ("event-threads", po::value(&event_threads)->default_value(1),
+         "Number of threads to process the track loops of the event (0 - number of cores)")
+        ("event-chunk-size", po::value(&event_chunk_size)->default_value(256),
+         "Number of tracks in the chunk of the parallel track loop")
+        ("plot-threads", po::value(&plot_threads)->default_value(0),
+         "Number of threads to project efficiencies (0 - number of cores)")
         ("qa-file-name", po::value(&qa_file_name)->default_value("efficiency_qa.root"))
-        ("validate-file", po::value(&validate_file)->default_value(""));
+        ("validate-file", po::value(&validate_file)->default_value(""))
+        ("output-profile", po::value(&output_profile_name)->default_value("full"),
+         "Output schema: 'full' or 'compact' (derived field nhits_ratio is not written)")
+        ("float-precision", po::value(&float_precision_definitions)->multitoken(),
+         "Quantize float output fields, format <field>:<absolute precision>")
+        ("count-allocations", po::value(&count_allocations)->default_value(false),
+         "Report heap allocations per event (requires -DATPID_ALLOCATION_COUNTER=ON)")
+        ("profile-scaling", po::value(&profile_scaling)->default_value(false),
+         "Report the processing time per event and per track (VtxTracks + SimTracks)")
+        ("profile-scaling-max-tracks", po::value(&profile_scaling_max_tracks)->default_value(10000),
+         "Upper edge of the logarithmic multiplicity bins of the scaling profile (VtxTracks + SimTracks)")
+        ("prune-input", po::value(&prune_input)->default_value(false),
+         "Read only the branches declared by the task");
     return desc;
   }
   return {};
@@ -103,19 +216,41 @@ void PidMatching::UserInit(std::map<std::string, void *> &map) {
   using AnalysisTree::Types;
 
   InitEfficiencies();
+  ++n_instances;
+
+  if (profile_scaling)
+    scaling_profile_ = ScalingProfile(profile_scaling_max_tracks);
+
+  /* same configuration for all instances */
+  sampler_.Configure(
+      sample_events > 0 ? EventSampler::EveryForTarget(in_chain_->GetEntries(), sample_events) : sample_every,
+      sample_seed);
+  if (sampler_.IsEnabled()) {
+    sampler_.InitEventId(map, *config_, sample_event_id);
+    sampler_.AddFlagBranch(out_tree_, GetName() + "_sampled");
+    output_branch_names.insert(GetName() + "_sampled");
+  }
+
+  const std::string checkpoint_path = checkpoint_prefix + "_" + GetName() + ".root";
+  if (resume) {
+    LoadCheckpoint(checkpoint_path);
+  }
+  output_begin_entry = std::min(output_begin_entry, resume_entry_);
+  if (checkpoint_interval > 0) {
+    checkpoint_writer_ = std::make_unique<CheckpointWriter>(checkpoint_path);
+  }
 
   matching_ptr_ = static_cast<Matching *>(map["VtxTracks2SimTracks"]);
   vtxt_branch = GetInBranch("VtxTracks");
   simt_branch = GetInBranch("SimTracks");
-  VtxTrackCut vtx_track_cut = {
-      .dcax_max = 2.,
-      .dcay_max = 1.,
-      .nhits_vtpc_min = 15,
-      .nhits_total_min = 30,
-      .ratio_nhits_nhits_pot_min = 0.55,
-      .ratio_nhits_nhits_pot_max = 1.10
-  };
-  vtx_track_cut.InitBranch(vtxt_branch);
+  InitCuts(vtxt_branch, simt_branch);
+  /* one pool for all instances, they are executed one after another. Without workers the loops run inline */
+  if (!event_pool) {
+    if (event_threads != 1)
+      ROOT::EnableThreadSafety();
+    event_pool = std::make_unique<ChunkPool>(event_threads);
+    cout << "Track loops of the event are run by " << event_pool->GetNThreads() << " threads" << endl;
+  }
 
 
   /// SIM Tracks
@@ -138,12 +273,24 @@ void PidMatching::UserInit(std::map<std::string, void *> &map) {
                       {"q", vtxt_charge},
                   });
 
+  /// OUTPUT SCHEMA
+  const auto output_profile = OutputProfile::Parse(output_profile_name, float_precision_definitions);
+  y_cm_precision_ = output_profile.Precision("y_cm");
+  nhits_ratio_precision_ = output_profile.Precision("nhits_ratio");
+  sim_y_cm_precision_ = output_profile.Precision("sim_y_cm");
+  sim_pt_precision_ = output_profile.Precision("sim_pt");
+  sim_phi_precision_ = output_profile.Precision("sim_phi");
+  write_nhits_ratio_ = !output_profile.Drops("nhits_ratio");
+
   /// MATCHED TRACKS
   mt_branch = NewBranch("RecParticles", PARTICLES);
+  output_branch_names.insert("RecParticles");
   mt_branch->CloneVariables(vtxt_branch->GetConfig());
   mt_y_cm_ = mt_branch->NewVariable("y_cm", FLOAT);
   mt_nhits_vtpc_ = mt_branch->NewVariable("nhits_vtpc", INTEGER);
-  mt_nhits_ratio_ = mt_branch->NewVariable("nhits_ratio", FLOAT);
+  if (write_nhits_ratio_) {
+    mt_nhits_ratio_ = mt_branch->NewVariable("nhits_ratio", FLOAT);
+  }
   mt_branch->UseFields({
                            {"pid", mt_pid},
                            {"mass", mt_mass},
@@ -156,41 +303,78 @@ void PidMatching::UserInit(std::map<std::string, void *> &map) {
   mt_sim_mother_id_ = mt_branch->NewVariable("sim_mother_id", INTEGER);
 
   /// SIM TRACKS (PROCESSED, e.g. with midrapidity calclulated)
-  simtproc_branch = NewBranch("SimTracksProc", PARTICLES);
-  simtproc_branch->CloneVariables(simt_branch->GetConfig());
-  simtproc_y_cm = simtproc_branch->NewVariable("y_cm", FLOAT);
+  if (sim_tracks_proc_mode == "all") {
+    sim_tracks_proc_filter_ = SimTracksProcFilter::kAll;
+  } else if (sim_tracks_proc_mode == "none") {
+    sim_tracks_proc_filter_ = SimTracksProcFilter::kNone;
+  } else if (sim_tracks_proc_mode == "primary") {
+    sim_tracks_proc_filter_ = SimTracksProcFilter::kPrimary;
+  } else if (sim_tracks_proc_mode == "species") {
+    sim_tracks_proc_filter_ = SimTracksProcFilter::kSpecies;
+    const auto &pdgs = sim_tracks_proc_species.empty() ? species : sim_tracks_proc_species;
+    sim_tracks_proc_pdgs_.insert(pdgs.begin(), pdgs.end());
+  } else {
+    throw std::runtime_error("Unknown --sim-tracks-proc '" + sim_tracks_proc_mode +
+        "', expected 'all', 'none', 'primary' or 'species'");
+  }
+  if (sim_tracks_proc_filter_ != SimTracksProcFilter::kNone) {
+    simtproc_branch = NewBranch("SimTracksProc", PARTICLES);
+    output_branch_names.insert("SimTracksProc");
+    simtproc_branch->CloneVariables(simt_branch->GetConfig());
+    simtproc_y_cm = simtproc_branch->NewVariable("y_cm", FLOAT);
+  }
 
 
   vtxt_branch->GetConfig().Print();
 
+  auto &read_set = InputReadSet::Instance();
+  if (prune_input) {
+    read_set.Declare("VtxTracks2SimTracks", {}, kReadSetOwner);
+    if (sampler_.IsEnabled())
+      read_set.Declare(sampler_.GetEventIdBranch(), {}, kReadSetOwner);
+    read_set.Declare("SimTracks", {"pdg", "mother_id"}, kReadSetOwner);
+    read_set.Declare("VtxTracks", {"dcax", "dcay", "q",
+                                   "nhits_vtpc1", "nhits_vtpc2", "nhits_mtpc",
+                                   "nhits_pot_vtpc1", "nhits_pot_vtpc2", "nhits_pot_mtpc"}, kReadSetOwner);
+  } else {
+    read_set.DeclareAll();
+  }
+
   mt_branch->Freeze();
 }
 
 void PidMatching::InitEfficiencies() {
   auto cwd = gDirectory;
 
-  qa_file_ = TFile::Open(qa_file_name.c_str(), "RECREATE");
-
-  auto linspace = [](size_t nb, double lo, double hi) {
-    auto result = new double[nb + 1];
-    auto step = (hi - lo) / nb;
-    for (size_t i = 0; i < nb; ++i) {
-      result[i] = lo + i * step;
-    }
-    result[nb] = hi;
-    return result;
-  };
+  const auto mult_axis_spec = AxisSpec::Parse(mult_axis_definition);
+  const auto y_axis_spec = AxisSpec::Parse(y_axis_definition);
+  const auto eta_axis_spec = AxisSpec::Parse(eta_axis_definition);
+  const auto pt_axis_spec = AxisSpec::Parse(pt_axis_definition);
+
+  const auto memory_estimate = EstimateEfficienciesMemory(mult_axis_spec, y_axis_spec, eta_axis_spec, pt_axis_spec);
+  const double memory_estimate_mb = double(memory_estimate) / (1024. * 1024.);
+  cout << "Estimated memory of QA histograms: " << memory_estimate_mb << " MB" << endl;
+  if (memory_budget_mb > 0. && memory_estimate_mb > memory_budget_mb) {
+    throw std::runtime_error("Estimated memory of QA histograms (" + std::to_string(memory_estimate_mb) +
+        " MB) exceeds the budget (" + std::to_string(memory_budget_mb) + " MB)");
+  }
 
-  Int_t mult_axis_size = 6;
-  const auto mult_axis = linspace(6, 0., 300.);
-  Int_t y_axis_size = 120;
-  const auto y_axis = linspace(y_axis_size, -2., 4.);
-  Int_t eta_axis_size = 120;
-  const auto eta_axis = linspace(eta_axis_size, 0., 6.);
-  Int_t pt_axis_size = 60;
-  const auto pt_axis = linspace(pt_axis_size, 0., 3.);
+  qa_file_ = TFile::Open(qa_file_name.c_str(), "RECREATE");
 
-  for (int pdg : {211, -211, 2212}) {
+  const Int_t mult_axis_size = mult_axis_spec.n_bins;
+  const auto mult_axis_edges = mult_axis_spec.Edges();
+  const auto mult_axis = mult_axis_edges.data();
+  const Int_t y_axis_size = y_axis_spec.n_bins;
+  const auto y_axis_edges = y_axis_spec.Edges();
+  const auto y_axis = y_axis_edges.data();
+  const Int_t eta_axis_size = eta_axis_spec.n_bins;
+  const auto eta_axis_edges = eta_axis_spec.Edges();
+  const auto eta_axis = eta_axis_edges.data();
+  const Int_t pt_axis_size = pt_axis_spec.n_bins;
+  const auto pt_axis_edges = pt_axis_spec.Edges();
+  const auto pt_axis = pt_axis_edges.data();
+
+  for (int pdg : species) {
     auto qa_struct = new PidEfficiencyQAStruct;
     efficiencies.emplace(pdg, qa_struct);
 
@@ -203,12 +387,22 @@ void PidMatching::InitEfficiencies() {
                                               pt_axis_size, pt_axis);
     qa_struct->sim_tracks_y_pt = (TH2 *) qa_struct->matched_tracks_y_pt->Clone("sim_tracks_y_pt");
 
-    qa_struct->matched_tracks_centr_y_pt = new TH3D("matched_tracks_centr_y_pt",
-                                                    "Multiplicity (Good VTX tracks);#it{y}_{CM};p_{T} (GeV/c)",
-                                                    mult_axis_size, mult_axis,
-                                                    y_axis_size, y_axis,
-                                                    pt_axis_size, pt_axis);
-    qa_struct->sim_tracks_centr_y_pt = (TH3 *) qa_struct->matched_tracks_centr_y_pt->Clone("sim_tracks_centr_y_pt");
+    if (sparse_centrality_maps) {
+      const TAxis sparse_mult_axis(mult_axis_size, mult_axis);
+      const TAxis sparse_y_axis(y_axis_size, y_axis);
+      const TAxis sparse_pt_axis(pt_axis_size, pt_axis);
+      qa_struct->tracks_centr_y_pt_sparse =
+          std::make_unique<SparseCounterMap>(sparse_mult_axis, sparse_y_axis, sparse_pt_axis);
+      qa_struct->matched_sim_sim_centr_y_pt_sparse =
+          std::make_unique<SparseCounterMap>(sparse_mult_axis, sparse_y_axis, sparse_pt_axis);
+    } else {
+      qa_struct->matched_tracks_centr_y_pt = new TH3D("matched_tracks_centr_y_pt",
+                                                      "Multiplicity (Good VTX tracks);#it{y}_{CM};p_{T} (GeV/c)",
+                                                      mult_axis_size, mult_axis,
+                                                      y_axis_size, y_axis,
+                                                      pt_axis_size, pt_axis);
+      qa_struct->sim_tracks_centr_y_pt = (TH3 *) qa_struct->matched_tracks_centr_y_pt->Clone("sim_tracks_centr_y_pt");
+    }
 
     qa_struct->matched_sim_sim_y_pt = new TEfficiency("matched_sim_sim_y_pt",
                                                       "N (Matched SimTracks) / N(SimTracks);#it{y}_{CM};p_{T} (GeV/c)",
@@ -218,14 +412,16 @@ void PidMatching::InitEfficiencies() {
         Clone("matched_vtx_primary_y_pt");
     qa_struct->matched_vtx_primary_y_pt->SetTitle("N (Primary Vtx tracks) / N (Vtx tracks) (after selection)");
 
-    qa_struct->matched_sim_sim_centr_y_pt = new TEfficiency("matched_sim_sim_centr_y_pt",
-                                                            "N (Matched SimTracks) / N(SimTracks);Centrality (%);#it{y}_{CM};p_{T} (GeV/c)",
-                                                            mult_axis_size,
-                                                            mult_axis,
-                                                            y_axis_size,
-                                                            y_axis,
-                                                            pt_axis_size,
-                                                            pt_axis);
+    if (!sparse_centrality_maps) {
+      qa_struct->matched_sim_sim_centr_y_pt = new TEfficiency("matched_sim_sim_centr_y_pt",
+                                                              "N (Matched SimTracks) / N(SimTracks);Centrality (%);#it{y}_{CM};p_{T} (GeV/c)",
+                                                              mult_axis_size,
+                                                              mult_axis,
+                                                              y_axis_size,
+                                                              y_axis,
+                                                              pt_axis_size,
+                                                              pt_axis);
+    }
 
     if (!validate_file.empty()) {
       auto validate_struct = std::make_shared<ValidateEfficiencyStruct>();
@@ -278,171 +474,639 @@ void PidMatching::InitEfficiencies() {
   // recover gDirectory
   cwd->cd();
 }
+size_t PidMatching::EstimateEfficienciesMemory(const AxisSpec &mult_axis,
+                                               const AxisSpec &y_axis,
+                                               const AxisSpec &eta_axis,
+                                               const AxisSpec &pt_axis) const {
+  const size_t cells_y_pt = y_axis.NCells() * pt_axis.NCells();
+  const size_t cells_centr_y_pt = mult_axis.NCells() * cells_y_pt;
+  const size_t cells_eta_pt = eta_axis.NCells() * pt_axis.NCells();
+
+  /* TH2D-s: matched, sim; TEfficiency-s (passed + total): matched_sim_sim, matched_vtx_primary, vtx_sim */
+  size_t species_cells = 8 * cells_y_pt;
+  /* TH3D-s: matched, sim; TEfficiency-s: matched_sim_sim, vtx_sim.
+   * Sparse maps are densified on write, so the peak is the same */
+  species_cells += 6 * cells_centr_y_pt;
+  if (!validate_file.empty()) {
+    /* TH2D-s: two weighted with Sumw2, sim, two ratios cloned from the weighted ones with Sumw2;
+     * two TEfficiency-s from the validation file */
+    species_cells += 13 * cells_y_pt;
+  }
+  const size_t species_bytes = species_cells * sizeof(Double_t);
+
+  /* three TEfficiency-s and two TH1I-s */
+  const size_t charged_hadrons_bytes = 6 * cells_eta_pt * sizeof(Double_t) +
+      (302 + mult_axis.NCells()) * sizeof(Int_t);
+
+  cout << "QA histograms: " << species.size() << " species x " << species_bytes << " bytes + "
+       << charged_hadrons_bytes << " bytes (charged hadrons)" << endl;
+  size_t total_bytes = species.size() * species_bytes + charged_hadrons_bytes;
+
+  if (checkpoint_interval > 0) {
+    /* one snapshot in flight, copies of GetAccumulators() with the sparse maps densified:
+     * TH2D-s matched, sim; TEfficiency-s matched_sim_sim, matched_vtx_primary;
+     * TH3D-s matched, sim; TEfficiency matched_sim_sim; validation TH2D-s: two weighted with Sumw2, sim */
+    size_t snapshot_cells = 6 * cells_y_pt + 4 * cells_centr_y_pt;
+    if (!validate_file.empty())
+      snapshot_cells += 5 * cells_y_pt;
+    const size_t snapshot_bytes = species.size() * snapshot_cells * sizeof(Double_t) + charged_hadrons_bytes;
+    cout << "Checkpoint snapshot: " << snapshot_bytes << " bytes" << endl;
+    total_bytes += snapshot_bytes;
+  }
+  return total_bytes;
+}
+
 void PidMatching::UserExec() {
 
-  using AnalysisTree::Types;
+  InputReadSet::Instance().Apply(in_chain_, config_);
+
+  const auto entry = in_chain_->GetReadEntry();
+  if (entry < output_begin_entry) {
+    /* accounted in the checkpoints of all instances */
+    SuspendOutput();
+    return;
+  }
+  BeginOutput();
+
+  if (n_converged_instances == n_instances) {
+    StopOutput();
+    /* empty, if the tree is shared with other tasks and can not be cut */
+    mt_branch->ClearChannels();
+    if (simtproc_branch)
+      simtproc_branch->ClearChannels();
+    return;
+  }
+
+  if (!sampler_.Process()) {
+    /* not selected, flagged in '<task>_sampled' */
+    mt_branch->ClearChannels();
+    if (simtproc_branch)
+      simtproc_branch->ClearChannels();
+    return;
+  }
+
+  if (count_allocations)
+    allocation_stats_.BeginEvent();
+
+  if (profile_scaling)
+    scaling_profile_.BeginEvent();
+
+  /* a converged instance writes its output until all of them converged, but does not account.
+   * Entries between output_begin_entry and the own checkpoint are written, not accounted */
+  const bool accumulate = !converged_ && entry >= resume_entry_;
+  ExecWithCuts(accumulate);
+
+  if (profile_scaling)
+    scaling_profile_.EndEvent(vtxt_branch->size() + simt_branch->size());
+  if (count_allocations)
+    allocation_stats_.EndEvent();
+
+  if (!accumulate)
+    return;
+  ++n_events_;
+  if (convergence_precision > 0. && convergence_check_interval > 0 &&
+      n_events_ % convergence_check_interval == 0) {
+    CheckConvergence();
+  }
+  if (checkpoint_writer_ && n_events_ % checkpoint_interval == 0) {
+    WriteCheckpoint();
+  }
+
+}
+
+template<typename CutPolicy>
+void PidMatching::ExecEvent(const CutPolicy &cuts, bool accumulate) {
+
   using AnalysisTree::Particle;
   using AnalysisTree::Track;
 
-  TLorentzVector sim_momentum;
-  TLorentzVector vtx_momentum;
+  auto &pool = *event_pool;
+  const double beam_rapidity = data_header_->GetBeamRapidity();
+  const size_t n_vtx = vtxt_branch->size();
+  const size_t n_sim = simt_branch->size();
+  const auto &match_inv = matching_ptr_->GetMatches(true);
+  const auto &match = matching_ptr_->GetMatches();
+
+  sim_pdgs_.resize(n_sim);
+  for (size_t i_sim = 0; i_sim < n_sim; ++i_sim) {
+    const auto sim_track = (*simt_branch)[i_sim];
+    const auto pdg = sim_track[sim_pdg_].GetInt();
+    sim_pdgs_[i_sim] = pdg;
+    if (mass_cache_.find(pdg) == mass_cache_.end())
+      mass_cache_.emplace(pdg, PdgHelper::mass(pdg));
+  }
 
-  int multiplicity = 0;
-  for (const auto &vtx_track : vtxt_branch->Loop()) {
-    if (CheckVtxTrack(vtx_track))
-      multiplicity++;
+  /* the selection of the vtx track is evaluated once and reused by all loops */
+  vtx_is_good_.resize(n_vtx);
+  pool.ParallelFor(n_vtx, event_chunk_size, [&](size_t begin, size_t end) {
+    for (size_t i_vtx = begin; i_vtx < end; ++i_vtx) {
+      vtx_is_good_[i_vtx] = cuts.CheckVtxTrack((*vtxt_branch)[i_vtx]);
+    }
+  });
+  const int multiplicity = int(std::count(vtx_is_good_.begin(), vtx_is_good_.end(), 1));
+  if (accumulate) {
+    charged_hadrons_efficiency->vtx_tracks_mult->Fill(multiplicity);
+    charged_hadrons_efficiency->vtx_tracks_mult_binned->Fill(multiplicity);
   }
-  charged_hadrons_efficiency->vtx_tracks_mult->Fill(multiplicity);
-  charged_hadrons_efficiency->vtx_tracks_mult_binned->Fill(multiplicity);
 
-  size_t counter_matched_good_vtx_tracks = 0;
+  /* matched tracks */
+  matches_.assign(match.begin(), match.end());
+  matched_results_.resize(matches_.size());
+  pool.ParallelFor(matches_.size(), event_chunk_size, [&](size_t begin, size_t end) {
+    TLorentzVector sim_momentum;
+    TLorentzVector vtx_momentum;
+    for (size_t i_match = begin; i_match < end; ++i_match) {
+      auto &&[vtx_id, sim_id] = matches_[i_match];
+      const auto vtx_track = (*vtxt_branch)[vtx_id];
+      const auto sim_track = (*simt_branch)[sim_id];
+      auto &result = matched_results_[i_match];
+
+      result.pdg = sim_pdgs_[sim_id];
+      sim_momentum.SetVectM(sim_track.DataT<Particle>()->GetMomentum3(), mass_cache_.at(result.pdg));
+      vtx_momentum.SetVectM(vtx_track.DataT<Track>()->GetMomentum3(), sim_momentum.M());
+      result.mass = sim_momentum.M();
+      result.y_cm = vtx_momentum.Rapidity() - beam_rapidity;
+      result.pt = vtx_momentum.Pt();
+      result.sim_y_cm = sim_momentum.Rapidity() - beam_rapidity;
+      result.sim_pt = sim_momentum.Pt();
+      result.sim_phi = sim_momentum.Phi();
+      result.sim_mother_id = sim_track[sim_mother_id_].GetInt();
+      result.nhits_vtpc = vtx_track[vtxt_nhits_vtpc1_].GetInt() + vtx_track[vtxt_nhits_vtpc2_].GetInt();
+      result.nhits_ratio = float(result.nhits_vtpc + vtx_track[vtxt_nhits_mtpc_].GetInt()) /
+          float(vtx_track[vtxt_nhits_pot_vtpc1_].GetInt() + vtx_track[vtxt_nhits_pot_vtpc2_].GetInt()
+                    + vtx_track[vtxt_nhits_pot_mtpc_].GetInt());
+      result.is_good_vtx = vtx_is_good_[vtx_id];
+
+      result.weight_msim_sim = 0.;
+      result.weight_vtx_sim = 0.;
+      auto validated_it = validated_efficiencies.find(result.pdg);
+      if (accumulate && result.is_good_vtx && validated_it != validated_efficiencies.end()) {
+        auto msim_sim = validated_it->second->efficiency_msim_sim_y_pt;
+        auto weight = 1. / msim_sim->GetEfficiency(msim_sim->FindFixBin(result.y_cm, result.pt));
+        result.weight_msim_sim = (weight < 100) ? weight : 0.;
+        auto vtx_sim = validated_it->second->efficiency_vtx_sim_y_pt;
+        weight = 1. / vtx_sim->GetEfficiency(vtx_sim->FindFixBin(result.y_cm, result.pt));
+        result.weight_vtx_sim = (weight < 100) ? weight : 0.;
+      }
+    }
+  });
 
+  size_t counter_matched_good_vtx_tracks = 0;
   mt_branch->ClearChannels();
-  for (auto &&[vtxId, simId] : matching_ptr_->GetMatches()) {
-    const auto vtx_track = (*vtxt_branch)[vtxId];
-    const auto sim_track = (*simt_branch)[simId];
+  for (size_t i_match = 0; i_match < matches_.size(); ++i_match) {
+    const auto &result = matched_results_[i_match];
 
     auto matched_track = mt_branch->NewChannel();
-    matched_track.CopyContents(vtx_track);
-
-    auto pdg = sim_track[sim_pdg_].GetInt();
-    sim_momentum.SetVectM(sim_track.DataT<Particle>()->GetMomentum3(), PdgHelper::mass(pdg));
-    vtx_momentum.SetVectM(vtx_track.DataT<Track>()->GetMomentum3(), sim_momentum.M());
-
-    matched_track[mt_pid] = pdg;
-    matched_track[mt_mass] = float(sim_momentum.M());
-    matched_track[mt_y_cm_] = float(vtx_momentum.Rapidity() - data_header_->GetBeamRapidity());
-    matched_track[mt_nhits_vtpc_] = vtx_track[vtxt_nhits_vtpc1_].GetInt() + vtx_track[vtxt_nhits_vtpc2_].GetInt();
-    matched_track[mt_nhits_ratio_] =
-        float(vtx_track[vtxt_nhits_vtpc1_].GetInt() + vtx_track[vtxt_nhits_vtpc2_].GetInt()
-                  + vtx_track[vtxt_nhits_mtpc_].GetInt()) /
-            float(vtx_track[vtxt_nhits_pot_vtpc1_].GetInt() + vtx_track[vtxt_nhits_pot_vtpc2_].GetInt()
-                      + vtx_track[vtxt_nhits_pot_mtpc_].GetInt());
-    /* sim-related information */
-    matched_track[mt_sim_y_cm_] = float(sim_momentum.Rapidity() - data_header_->GetBeamRapidity());
-    matched_track[mt_sim_pt_] = float(sim_momentum.Pt());
-    matched_track[mt_sim_phi_] = float(sim_momentum.Phi());
-    matched_track[mt_sim_mother_id_] = sim_track[sim_mother_id_];
-
-    const bool is_good_vtx = CheckVtxTrack(vtx_track);
-
-    if (is_good_vtx) {
-      ++counter_matched_good_vtx_tracks;
+    matched_track.CopyContents((*vtxt_branch)[matches_[i_match].first]);
+    matched_track[mt_pid] = result.pdg;
+    matched_track[mt_mass] = float(result.mass);
+    matched_track[mt_y_cm_] = QuantizeFloat(float(result.y_cm), y_cm_precision_);
+    matched_track[mt_nhits_vtpc_] = result.nhits_vtpc;
+    if (write_nhits_ratio_) {
+      matched_track[mt_nhits_ratio_] = QuantizeFloat(result.nhits_ratio, nhits_ratio_precision_);
     }
-
-    if (efficiencies.find(pdg) != efficiencies.end()) {
-//      if (CheckVtxTrack(vtx_track) && CheckSimTrack(sim_track)) {
-      /* For the real data checking of whether this track primary or not is not possible */
-      if (is_good_vtx) {
-        efficiencies[pdg]->matched_tracks_y_pt->Fill(vtx_momentum.Rapidity() - data_header_->GetBeamRapidity(),
-                                                     vtx_momentum.Pt());
-        efficiencies[pdg]->matched_tracks_centr_y_pt->Fill(
-            multiplicity,
-            vtx_momentum.Rapidity() - data_header_->GetBeamRapidity(),
-            vtx_momentum.Pt());
-        efficiencies[pdg]->matched_vtx_primary_y_pt->Fill(
-            sim_track[sim_mother_id_].GetInt() == -1,
-            vtx_momentum.Rapidity() - data_header_->GetBeamRapidity(),
-            vtx_momentum.Pt());
+    matched_track[mt_sim_y_cm_] = QuantizeFloat(float(result.sim_y_cm), sim_y_cm_precision_);
+    matched_track[mt_sim_pt_] = QuantizeFloat(float(result.sim_pt), sim_pt_precision_);
+    matched_track[mt_sim_phi_] = QuantizeFloat(float(result.sim_phi), sim_phi_precision_);
+    matched_track[mt_sim_mother_id_] = result.sim_mother_id;
+
+    if (!result.is_good_vtx)
+      continue;
+    ++counter_matched_good_vtx_tracks;
+    if (!accumulate)
+      continue;
+
+    auto efficiency_it = efficiencies.find(result.pdg);
+    if (efficiency_it != efficiencies.end()) {
+      auto &efficiency = efficiency_it->second;
+      efficiency->matched_tracks_y_pt->Fill(result.y_cm, result.pt);
+      if (efficiency->tracks_centr_y_pt_sparse) {
+        efficiency->tracks_centr_y_pt_sparse->Fill(0, multiplicity, result.y_cm, result.pt);
+      } else {
+        efficiency->matched_tracks_centr_y_pt->Fill(multiplicity, result.y_cm, result.pt);
       }
+      efficiency->matched_vtx_primary_y_pt->Fill(result.sim_mother_id == -1, result.y_cm, result.pt);
     }
 
-    if (validated_efficiencies.find(pdg) != validated_efficiencies.end()) {
-//      if (CheckVtxTrack(vtx_track) && CheckSimTrack(sim_track)) {
-      /* For the real data checking of whether this track primary or not is not possible */
-      if (is_good_vtx) {
-        {
-          auto msim_sim = validated_efficiencies[pdg]->efficiency_msim_sim_y_pt;
-          auto efficiency_msim_sim = msim_sim->GetEfficiency(
-              msim_sim->FindFixBin(vtx_momentum.Rapidity() - data_header_->GetBeamRapidity(),
-                                   vtx_momentum.Pt()));
-          auto weight = 1. / efficiency_msim_sim;
-          weight = (weight < 100) ? weight : 0.;
-          validated_efficiencies[pdg]->vtx_tracks_y_pt_wmsim_sim->Fill(
-              vtx_momentum.Rapidity() - data_header_->GetBeamRapidity(),
-              vtx_momentum.Pt(), weight);
-        }
-
-        {
-          auto vtx_sim = validated_efficiencies[pdg]->efficiency_vtx_sim_y_pt;
-          auto efficiency_vtx_sim = vtx_sim->GetEfficiency(
-              vtx_sim->FindFixBin(vtx_momentum.Rapidity() - data_header_->GetBeamRapidity(),
-                                  vtx_momentum.Pt()));
-          auto weight = 1. / efficiency_vtx_sim;
-          weight = (weight < 100) ? weight : 0.;
-          validated_efficiencies[pdg]->vtx_tracks_y_pt_wvtx_sim->Fill(
-              vtx_momentum.Rapidity() - data_header_->GetBeamRapidity(),
-              vtx_momentum.Pt(), weight);
-        }
+    auto validated_it = validated_efficiencies.find(result.pdg);
+    if (validated_it != validated_efficiencies.end()) {
+      validated_it->second->vtx_tracks_y_pt_wmsim_sim->Fill(result.y_cm, result.pt, result.weight_msim_sim);
+      validated_it->second->vtx_tracks_y_pt_wvtx_sim->Fill(result.y_cm, result.pt, result.weight_vtx_sim);
+    }
+  } // matched particles
 
+  /* sim tracks */
+  sim_results_.resize(n_sim);
+  pool.ParallelFor(n_sim, event_chunk_size, [&](size_t begin, size_t end) {
+    TLorentzVector sim_momentum;
+    for (size_t i_sim = begin; i_sim < end; ++i_sim) {
+      const auto sim_track = (*simt_branch)[i_sim];
+      const auto pdg = sim_pdgs_[i_sim];
+      auto &result = sim_results_[i_sim];
+
+      result.is_selected = cuts.CheckSimTrack(sim_track);
+      switch (sim_tracks_proc_filter_) {
+        case SimTracksProcFilter::kAll: result.write_proc = true; break;
+        case SimTracksProcFilter::kNone: result.write_proc = false; break;
+        case SimTracksProcFilter::kPrimary: result.write_proc = result.is_selected; break;
+        case SimTracksProcFilter::kSpecies: result.write_proc = sim_tracks_proc_pdgs_.count(pdg) > 0; break;
       }
+      if (!result.write_proc && !result.is_selected)
+        continue;
+
+      sim_momentum.SetVectM(sim_track.DataT<Particle>()->GetMomentum3(), mass_cache_.at(pdg));
+      result.y_cm = sim_momentum.Rapidity() - beam_rapidity;
+      result.pt = sim_momentum.Pt();
+      auto match_it = match_inv.find(sim_track.GetNChannel());
+      result.has_matched_vtx_track = match_it != match_inv.end() && vtx_is_good_[match_it->second];
+    }
+  });
+
+  if (simtproc_branch)
+    simtproc_branch->ClearChannels();
+  for (size_t i_sim = 0; i_sim < n_sim; ++i_sim) {
+    const auto &result = sim_results_[i_sim];
+    const auto pdg = sim_pdgs_[i_sim];
+
+    if (result.write_proc) {
+      auto simtproc_particle = simtproc_branch->NewChannel();
+      simtproc_particle.CopyContents((*simt_branch)[i_sim]);
+      simtproc_particle[simtproc_y_cm] = QuantizeFloat(float(result.y_cm), y_cm_precision_);
     }
 
-  } // matched particles
+    if (!result.is_selected || !accumulate)
+      continue;
+
+    auto efficiency_it = efficiencies.find(pdg);
+    if (efficiency_it != efficiencies.end()) {
+      auto &efficiency = efficiency_it->second;
+      efficiency->sim_tracks_y_pt->Fill(result.y_cm, result.pt);
+      if (efficiency->tracks_centr_y_pt_sparse) {
+        efficiency->tracks_centr_y_pt_sparse->Fill(1, multiplicity, result.y_cm, result.pt);
+      } else {
+        efficiency->sim_tracks_centr_y_pt->Fill(multiplicity, result.y_cm, result.pt);
+      }
+      efficiency->matched_sim_sim_y_pt->Fill(result.has_matched_vtx_track, result.y_cm, result.pt);
+      if (efficiency->matched_sim_sim_centr_y_pt_sparse) {
+        efficiency->matched_sim_sim_centr_y_pt_sparse->FillEfficiency(result.has_matched_vtx_track,
+                                                                      multiplicity, result.y_cm, result.pt);
+      } else {
+        efficiency->matched_sim_sim_centr_y_pt->Fill(result.has_matched_vtx_track,
+                                                     multiplicity, result.y_cm, result.pt);
+      }
+    }
 
-  const auto match_inv = matching_ptr_->GetMatches(true);
-  const auto match = matching_ptr_->GetMatches();
+    auto validated_it = validated_efficiencies.find(pdg);
+    if (validated_it != validated_efficiencies.end()) {
+      validated_it->second->sim_tracks_y_pt->Fill(result.y_cm, result.pt);
+    }
+  } // sim tracks
 
-  simtproc_branch->ClearChannels();
-  for (const auto &sim_track : simt_branch->Loop()) {
-    auto pdg = sim_track[sim_pdg_].GetInt();
-    sim_momentum.SetVectM(sim_track.DataT<Particle>()->GetMomentum3(), PdgHelper::mass(pdg));
+  /* charged hadrons */
+  vtx_results_.resize(n_vtx);
+  pool.ParallelFor(accumulate ? n_vtx : 0, event_chunk_size, [&](size_t begin, size_t end) {
+    for (size_t i_vtx = begin; i_vtx < end; ++i_vtx) {
+      if (!vtx_is_good_[i_vtx])
+        continue;
+      const auto vtx_track = (*vtxt_branch)[i_vtx];
+      auto &result = vtx_results_[i_vtx];
+      const auto momentum = vtx_track.DataT<Track>()->GetMomentum3();
+      result.eta = momentum.Eta();
+      result.pt = momentum.Pt();
+      result.charge = vtx_track[vtxt_charge].GetInt();
+      result.has_matching_sim_track = match.find(vtx_track.GetNChannel()) != match.end();
+    }
+  });
+
+  for (size_t i_vtx = 0; accumulate && i_vtx < n_vtx; ++i_vtx) {
+    if (!vtx_is_good_[i_vtx])
+      continue;
+    const auto &result = vtx_results_[i_vtx];
+    charged_hadrons_efficiency->eta_pt_vtx_tracks->Fill(result.has_matching_sim_track, result.eta, result.pt);
+    if (result.charge < 0) {
+      charged_hadrons_efficiency->eta_pt_vtx_tracks_neg->Fill(result.has_matching_sim_track, result.eta, result.pt);
+    } else if (result.charge > 0) {
+      charged_hadrons_efficiency->eta_pt_vtx_tracks_pos->Fill(result.has_matching_sim_track, result.eta, result.pt);
+    }
+  } // vtx tracks
 
-    const auto y_cm = sim_momentum.Rapidity() - data_header_->GetBeamRapidity();
+  cout << endl;
+  cout << "Matched " << mt_branch->size() << "/" << n_vtx
+       << " vertex tracks" << endl;
+  cout << "Matched " << counter_matched_good_vtx_tracks << "/" << multiplicity
+       << " good vertex tracks" << endl;
+}
 
-    auto simtproc_particle = simtproc_branch->NewChannel();
-    simtproc_particle.CopyContents(sim_track);
-    simtproc_particle[simtproc_y_cm] = float(y_cm);
+std::vector<std::pair<std::string, TObject *>> PidMatching::GetAccumulators() const {
+  std::vector<std::pair<std::string, TObject *>> accumulators;
+  auto add = [&accumulators](const TDirectory *dir, TObject *object) {
+    if (object)
+      accumulators.emplace_back(std::string(dir->GetName()) + "/" + object->GetName(), object);
+  };
+  for (auto &&[pdg, efficiency] : efficiencies) {
+    auto dir = efficiency->output_dir;
+    add(dir, efficiency->matched_tracks_y_pt);
+    add(dir, efficiency->sim_tracks_y_pt);
+    add(dir, efficiency->matched_sim_sim_y_pt);
+    add(dir, efficiency->matched_vtx_primary_y_pt);
+    add(dir, efficiency->matched_tracks_centr_y_pt);
+    add(dir, efficiency->sim_tracks_centr_y_pt);
+    add(dir, efficiency->matched_sim_sim_centr_y_pt);
+  }
+  for (auto &&[pdg, validated_efficiency] : validated_efficiencies) {
+    auto dir = validated_efficiency->output_dir;
+    add(dir, validated_efficiency->vtx_tracks_y_pt_wmsim_sim);
+    add(dir, validated_efficiency->vtx_tracks_y_pt_wvtx_sim);
+    add(dir, validated_efficiency->sim_tracks_y_pt);
+  }
+  auto dir = charged_hadrons_efficiency->output_dir;
+  add(dir, charged_hadrons_efficiency->eta_pt_vtx_tracks);
+  add(dir, charged_hadrons_efficiency->eta_pt_vtx_tracks_neg);
+  add(dir, charged_hadrons_efficiency->eta_pt_vtx_tracks_pos);
+  add(dir, charged_hadrons_efficiency->vtx_tracks_mult);
+  add(dir, charged_hadrons_efficiency->vtx_tracks_mult_binned);
+  return accumulators;
+}
 
-    if (!CheckSimTrack(sim_track)) continue;
+CheckpointWriter::Snapshot PidMatching::MakeSnapshot() const {
+  const bool add_directory_status = TH1::AddDirectoryStatus();
+  TH1::AddDirectory(false);
+
+  CheckpointWriter::Snapshot snapshot;
+  for (auto &&[path, object] : GetAccumulators()) {
+    std::unique_ptr<TObject> copy(object->Clone());
+    if (auto histo = dynamic_cast<TH1 *>(copy.get()))
+      histo->SetDirectory(nullptr);
+    else if (auto eff = dynamic_cast<TEfficiency *>(copy.get()))
+      eff->SetDirectory(nullptr);
+    snapshot.emplace_back(path, std::move(copy));
+  }
+  /* sparse maps are stored dense, same as without them */
+  for (auto &&[pdg, efficiency] : efficiencies) {
+    if (!efficiency->tracks_centr_y_pt_sparse)
+      continue;
+    const std::string dir_name(efficiency->output_dir->GetName());
+    snapshot.emplace_back(dir_name + "/matched_tracks_centr_y_pt",
+                          efficiency->tracks_centr_y_pt_sparse->ToTH3(0, "matched_tracks_centr_y_pt", ""));
+    snapshot.emplace_back(dir_name + "/sim_tracks_centr_y_pt",
+                          efficiency->tracks_centr_y_pt_sparse->ToTH3(1, "sim_tracks_centr_y_pt", ""));
+    snapshot.emplace_back(dir_name + "/matched_sim_sim_centr_y_pt",
+                          efficiency->matched_sim_sim_centr_y_pt_sparse->ToEfficiency("matched_sim_sim_centr_y_pt", ""));
+  }
 
-    if (efficiencies.find(pdg) != efficiencies.end()) {
-      efficiencies[pdg]->sim_tracks_y_pt->Fill(y_cm, sim_momentum.Pt());
-      efficiencies[pdg]->sim_tracks_centr_y_pt->Fill(
-          multiplicity,y_cm, sim_momentum.Pt());
+  TH1::AddDirectory(add_directory_status);
+  return snapshot;
+}
 
-      auto has_matched_vtx_track = match_inv.find(sim_track.GetNChannel()) != match_inv.end()
-          && CheckVtxTrack((*vtxt_branch)[match_inv.at(sim_track.GetNChannel())]);
-      efficiencies[pdg]->matched_sim_sim_y_pt->Fill(has_matched_vtx_track,y_cm, sim_momentum.Pt());
-      efficiencies[pdg]->matched_sim_sim_centr_y_pt->Fill(has_matched_vtx_track,
-                                                          multiplicity,y_cm, sim_momentum.Pt());
-    }
+void PidMatching::WriteCheckpoint() {
+  if (checkpoint_writer_->IsBusy()) {
+    cout << GetName() << ": previous checkpoint is still being written, skipping" << endl;
+    return;
+  }
+  /* the previous snapshot is released before the copies are made */
+  checkpoint_writer_->Wait();
+  auto snapshot = MakeSnapshot();
+  /* state needed to validate and continue the run */
+  snapshot.emplace_back("input_files", std::make_unique<TObjString>(GetInputFileList().c_str()));
+  snapshot.emplace_back("n_input_entries", std::make_unique<TParameter<Long64_t>>("n_input_entries", in_chain_->GetEntries()));
+  snapshot.emplace_back("converged", std::make_unique<TParameter<Int_t>>("converged", converged_));
+  snapshot.emplace_back("sampling_every", std::make_unique<TParameter<Int_t>>("sampling_every", sampler_.GetEvery()));
+  snapshot.emplace_back("sampling_seed", std::make_unique<TParameter<Long64_t>>("sampling_seed", sampler_.GetSeed()));
+  checkpoint_writer_->Submit(std::move(snapshot), in_chain_->GetReadEntry() + 1, Long64_t(n_events_));
+}
 
-    if (validated_efficiencies.find(pdg) != validated_efficiencies.end()) {
-      validated_efficiencies[pdg]->sim_tracks_y_pt->Fill(y_cm, sim_momentum.Pt());
+std::string PidMatching::GetInputFileList() const {
+  std::string file_list;
+  if (auto chain = dynamic_cast<TChain *>(in_chain_)) {
+    for (auto element : *chain->GetListOfFiles()) {
+      file_list += element->GetTitle();
+      file_list += "\n";
     }
-  } // sim tracks
+  } else if (in_chain_->GetCurrentFile()) {
+    file_list = in_chain_->GetCurrentFile()->GetName();
+  }
+  return file_list;
+}
 
-  for (const auto &vtx_track : vtxt_branch->Loop()) {
+void PidMatching::LoadCheckpoint(const std::string &path) {
+  TFile checkpoint_file(path.c_str(), "READ");
+  if (!checkpoint_file.IsOpen())
+    throw std::runtime_error("Unable to open checkpoint '" + path + "'");
+
+  auto get_stored = [&checkpoint_file, &path](const std::string &object_path, const TClass *expected_class) {
+    auto stored = checkpoint_file.Get(object_path.c_str());
+    if (!stored)
+      throw std::runtime_error("Object '" + object_path + "' is missing in the checkpoint '" + path + "'");
+    if (!stored->InheritsFrom(expected_class))
+      throw std::runtime_error("Object '" + object_path + "' in the checkpoint '" + path + "' is not " +
+          expected_class->GetName());
+    return stored;
+  };
+  auto get_parameter = [&get_stored](const std::string &name) {
+    return static_cast<TParameter<Long64_t> *>(get_stored(name, TParameter<Long64_t>::Class()))->GetVal();
+  };
+  auto get_int_parameter = [&get_stored](const std::string &name) {
+    return static_cast<TParameter<Int_t> *>(get_stored(name, TParameter<Int_t>::Class()))->GetVal();
+  };
 
-    auto momentum = vtx_track.DataT<Track>()->GetMomentum3();
-    if (CheckVtxTrack(vtx_track)) {
-      auto has_matching_sim_track = match.find(vtx_track.GetNChannel()) != match.end();
-      charged_hadrons_efficiency->eta_pt_vtx_tracks->Fill(has_matching_sim_track, momentum.Eta(), momentum.Pt());
+  /* the input position is an entry of the chain, it is valid only for the same input */
+  auto input_files = static_cast<TObjString *>(get_stored("input_files", TObjString::Class()));
+  if (input_files->GetString() != GetInputFileList().c_str() ||
+      get_parameter("n_input_entries") != in_chain_->GetEntries()) {
+    throw std::runtime_error("Checkpoint '" + path + "' was written for different input files:\n" +
+        input_files->GetString().Data());
+  }
+  if (get_int_parameter("sampling_every") != Int_t(sampler_.GetEvery()) ||
+      uint64_t(get_parameter("sampling_seed")) != sampler_.GetSeed()) {
+    throw std::runtime_error("Checkpoint '" + path + "' was written with different event sampling");
+  }
 
-      if (vtx_track[vtxt_charge] < 0) {
-        charged_hadrons_efficiency->eta_pt_vtx_tracks_neg->Fill(has_matching_sim_track, momentum.Eta(), momentum.Pt());
-      } else if (vtx_track[vtxt_charge] > 0) {
-        charged_hadrons_efficiency->eta_pt_vtx_tracks_pos->Fill(has_matching_sim_track, momentum.Eta(), momentum.Pt());
-      }
+  auto check_binning = [&path](const std::string &object_path, const TH1 &stored, const TH1 &histo) {
+    if (stored.GetDimension() != histo.GetDimension() || stored.GetNcells() != histo.GetNcells())
+      throw std::runtime_error("Object '" + object_path + "' in the checkpoint '" + path + "' has different binning");
+  };
+  for (auto &&[object_path, object] : GetAccumulators()) {
+    if (auto eff = dynamic_cast<TEfficiency *>(object)) {
+      auto stored = static_cast<TEfficiency *>(get_stored(object_path, TEfficiency::Class()));
+      check_binning(object_path, *stored->GetTotalHistogram(), *eff->GetTotalHistogram());
+      eff->Add(*stored);
+    } else if (auto histo = dynamic_cast<TH1 *>(object)) {
+      auto stored = static_cast<TH1 *>(get_stored(object_path, TH1::Class()));
+      check_binning(object_path, *stored, *histo);
+      histo->Add(stored);
     }
+  }
+  for (auto &&[pdg, efficiency] : efficiencies) {
+    if (!efficiency->tracks_centr_y_pt_sparse)
+      continue;
+    const std::string dir_name(efficiency->output_dir->GetName());
+    auto get_stored_3d = [&](const std::string &object_path, const SparseCounterMap &counters) {
+      auto stored = static_cast<TH1 *>(get_stored(object_path, TH1::Class()));
+      if (!counters.HasSameBinning(*stored))
+        throw std::runtime_error("Object '" + object_path + "' in the checkpoint '" + path + "' has different binning");
+      return stored;
+    };
+    auto &tracks = *efficiency->tracks_centr_y_pt_sparse;
+    auto &matched_sim_sim = *efficiency->matched_sim_sim_centr_y_pt_sparse;
+    tracks.AddCounters(0, *get_stored_3d(dir_name + "/matched_tracks_centr_y_pt", tracks));
+    tracks.AddCounters(1, *get_stored_3d(dir_name + "/sim_tracks_centr_y_pt", tracks));
+    auto stored_efficiency = static_cast<TEfficiency *>(
+        get_stored(dir_name + "/matched_sim_sim_centr_y_pt", TEfficiency::Class()));
+    if (!matched_sim_sim.HasSameBinning(*stored_efficiency->GetTotalHistogram()))
+      throw std::runtime_error("Object '" + dir_name + "/matched_sim_sim_centr_y_pt' in the checkpoint '" + path +
+          "' has different binning");
+    matched_sim_sim.AddEfficiency(*stored_efficiency);
+  }
 
-  } // vtx tracks
+  resume_entry_ = get_parameter("next_entry");
+  n_events_ = size_t(get_parameter("n_events"));
+  if (get_int_parameter("converged")) {
+    converged_ = true;
+    ++n_converged_instances;
+  }
+  cout << GetName() << ": resumed from '" << path << "' at entry " << resume_entry_
+       << " (" << n_events_ << " events accounted" << (converged_ ? ", converged" : "") << ")" << endl;
+}
 
+double PidMatching::EvalAchievedPrecision() const {
+  double achieved_precision = 0.;
+  for (auto &&[pdg, efficiency] : efficiencies) {
+    /* vtx_sim_y_pt is built from these two in UserFinish */
+    achieved_precision = std::max(achieved_precision, EfficiencyPrecisionQuantile(
+        *efficiency->matched_tracks_y_pt, *efficiency->sim_tracks_y_pt, convergence_fraction));
+    achieved_precision = std::max(achieved_precision, EfficiencyPrecisionQuantile(
+        *efficiency->matched_sim_sim_y_pt->GetPassedHistogram(),
+        *efficiency->matched_sim_sim_y_pt->GetTotalHistogram(), convergence_fraction));
+  }
+  return achieved_precision;
+}
 
-  cout << endl;
-  cout << "Matched " << mt_branch->size() << "/" << vtxt_branch->size()
-       << " vertex tracks" << endl;
-  cout << "Matched " << counter_matched_good_vtx_tracks << "/" << multiplicity
-       << " good vertex tracks" << endl;
+void PidMatching::CheckConvergence() {
+  const auto achieved_precision = EvalAchievedPrecision();
+  cout << GetName() << ": " << n_events_ << " events, relative uncertainty in "
+       << convergence_fraction * 100 << "% of bins: " << achieved_precision << endl;
+  if (achieved_precision > convergence_precision)
+    return;
+
+  converged_ = true;
+  ++n_converged_instances;
+  cout << GetName() << ": converged after " << n_events_ << " events" << endl;
+  if (n_converged_instances == n_instances) {
+    cout << "All tasks converged at entry " << in_chain_->GetReadEntry() << endl;
+  }
+}
+
+void PidMatching::StopOutput() {
+  if (output_stopped)
+    return;
+  output_stopped = true;
+  /* the input branches read only by PidMatching are not decompressed anymore */
+  InputReadSet::Instance().Release(in_chain_, kReadSetOwner);
 
+  if (!OwnsOutputTree()) {
+    cout << "Output tree is shared with other tasks, PidMatching branches are empty after convergence" << endl;
+    return;
+  }
+  /* entries are still counted by TTree::Fill() of the framework, disabled branches are not filled.
+   * UserFinish restores the branches and cuts the tree at n_output_entries */
+  output_cut = true;
+  n_output_entries = out_tree_->GetEntries();
+  SetOutputBranchStatus(false);
 }
+
+void PidMatching::SuspendOutput() {
+  if (output_suspended || output_cut)
+    return;
+  output_suspended = true;
+  /* the tree is emptied in BeginOutput, otherwise PidMatching branches are empty before output_begin_entry */
+  if (OwnsOutputTree())
+    SetOutputBranchStatus(false);
+}
+
+void PidMatching::BeginOutput() {
+  if (!output_suspended)
+    return;
+  output_suspended = false;
+  if (OwnsOutputTree()) {
+    SetOutputBranchStatus(true);
+    out_tree_->SetEntries(0);
+  }
+  /* to merge the output with the one of the interrupted run */
+  out_tree_->GetUserInfo()->Add(new TParameter<Long64_t>("PidMatching_first_input_entry", output_begin_entry));
+  cout << "Output of the resumed run starts at the input entry " << output_begin_entry
+       << ", merge it with the entries before it from the interrupted run" << endl;
+}
+
+bool PidMatching::OwnsOutputTree() const {
+  for (auto object : *out_tree_->GetListOfBranches()) {
+    std::string branch_name = object->GetName();
+    if (!branch_name.empty() && branch_name.back() == '.')
+      branch_name.pop_back();
+    if (output_branch_names.count(branch_name) == 0)
+      return false;
+  }
+  return true;
+}
+
+void PidMatching::SetOutputBranchStatus(bool status) {
+  for (auto object : *out_tree_->GetListOfBranches()) {
+    std::string branch_name = object->GetName();
+    const bool has_dot = !branch_name.empty() && branch_name.back() == '.';
+    if (output_branch_names.count(has_dot ? branch_name.substr(0, branch_name.size() - 1) : branch_name) == 0)
+      continue;
+    UInt_t n_found = 0;
+    out_tree_->SetBranchStatus(branch_name.c_str(), status, &n_found);
+    out_tree_->SetBranchStatus((branch_name + (has_dot ? "*" : ".*")).c_str(), status, &n_found);
+  }
+}
+
 void PidMatching::UserFinish() {
   cout << __func__ << endl;
+  /* all input entries were accounted in the checkpoint */
+  BeginOutput();
+  if (output_cut) {
+    SetOutputBranchStatus(true);
+    out_tree_->SetEntries(n_output_entries);
+    output_cut = false;
+    cout << "Output tree is cut at " << n_output_entries << " entries after convergence" << endl;
+  }
+  if (checkpoint_writer_) {
+    checkpoint_writer_->Wait();
+  }
+  if (convergence_precision > 0.) {
+    cout << GetName() << ": " << (converged_ ? "converged" : "not converged") << " after " << n_events_
+         << " events, achieved relative uncertainty in " << convergence_fraction * 100 << "% of bins: "
+         << EvalAchievedPrecision() << " (target " << convergence_precision << ")" << endl;
+  }
+
+  if (sampler_.IsEnabled()) {
+    sampler_.Print(cout, GetName());
+    sampler_.Record(out_tree_->GetUserInfo(), GetName());
+    /* histograms are not rescaled, fraction is stored for normalization */
+    TParameter<Double_t> sampling_fraction("sampling_fraction", sampler_.GetFraction());
+    qa_file_->WriteTObject(&sampling_fraction);
+  }
+
   auto cwd = gDirectory;
+  std::vector<EfficiencyDirSpec> plot_specs;
   for (auto &&[pdg, efficiency] : efficiencies) {
     efficiency->output_dir->cd();
 
+    if (efficiency->tracks_centr_y_pt_sparse) {
+      cout << "Densifying " << efficiency->tracks_centr_y_pt_sparse->GetNCells() << " + "
+           << efficiency->matched_sim_sim_centr_y_pt_sparse->GetNCells()
+           << " non-empty cells of centrality maps for " << pdg << endl;
+      efficiency->matched_tracks_centr_y_pt = efficiency->tracks_centr_y_pt_sparse->ToTH3(0,
+          "matched_tracks_centr_y_pt", "Multiplicity (Good VTX tracks);#it{y}_{CM};p_{T} (GeV/c)");
+      efficiency->sim_tracks_centr_y_pt = efficiency->tracks_centr_y_pt_sparse->ToTH3(1,
+          "sim_tracks_centr_y_pt", "Multiplicity (Good VTX tracks);#it{y}_{CM};p_{T} (GeV/c)");
+      efficiency->matched_sim_sim_centr_y_pt = efficiency->matched_sim_sim_centr_y_pt_sparse->ToEfficiency(
+          "matched_sim_sim_centr_y_pt",
+          "N (Matched SimTracks) / N(SimTracks);Centrality (%);#it{y}_{CM};p_{T} (GeV/c)");
+      efficiency->tracks_centr_y_pt_sparse.reset();
+      efficiency->matched_sim_sim_centr_y_pt_sparse.reset();
+    }
+
     efficiency->matched_tracks_y_pt->Write();
     efficiency->sim_tracks_y_pt->Write();
 
@@ -483,7 +1147,12 @@ void PidMatching::UserFinish() {
     efficiency->vtx_sim_centr_y_pt->Write("vtx_sim_centr_y_pt");
 
     if (save_canvases) {
-      ProcessEfficiencyDir(efficiency->output_dir);
+      plot_specs.push_back({efficiency->output_dir, {
+          efficiency->matched_sim_sim_centr_y_pt,
+          efficiency->matched_vtx_primary_y_pt,
+          efficiency->vtx_sim_y_pt,
+          efficiency->matched_sim_sim_y_pt,
+          efficiency->vtx_sim_centr_y_pt}});
     }
 
   }
@@ -496,7 +1165,10 @@ void PidMatching::UserFinish() {
     charged_hadrons_efficiency->eta_pt_vtx_tracks_neg->Write();
     charged_hadrons_efficiency->eta_pt_vtx_tracks_pos->Write();
     if (save_canvases) {
-      ProcessEfficiencyDir(charged_hadrons_efficiency->output_dir);
+      plot_specs.push_back({charged_hadrons_efficiency->output_dir, {
+          charged_hadrons_efficiency->eta_pt_vtx_tracks,
+          charged_hadrons_efficiency->eta_pt_vtx_tracks_neg,
+          charged_hadrons_efficiency->eta_pt_vtx_tracks_pos}});
     }
   }
 
@@ -521,10 +1193,21 @@ void PidMatching::UserFinish() {
     validated_efficiency->vtx_sim_y_pt_wvtx_sim->SetMaximum(1.1);
     validated_efficiency->vtx_sim_y_pt_wvtx_sim->Write();
     if (save_canvases) {
-      ProcessEfficiencyDir(validated_efficiency->output_dir);
+      plot_specs.push_back({validated_efficiency->output_dir, {}});
     }
   }
+
+  if (!plot_specs.empty()) {
+    ProcessEfficiencies(plot_specs, plot_threads);
+  }
   cwd->cd();
+
+  if (count_allocations)
+    allocation_stats_.Report(cout, GetName());
+  if (profile_scaling) {
+    scaling_profile_.Report(cout, GetName());
+    scaling_profile_.Record(out_tree_->GetUserInfo(), GetName());
+  }
 }
 
 void PidMatching::PostFinish() {
@@ -536,3 +1219,6 @@ void PidMatching::PostFinish() {
   }
 
 }
+
+PID_MATCHING_TASK_IMPL(PidMatching_NoCuts, NoCutsPolicy)
+PID_MATCHING_TASK_IMPL(PidMatching_StandardCuts, StandardCutsPolicy)
@@ -16,6 +16,17 @@
 
 #include <TEfficiency.h>
 
+#include <set>
+#include <unordered_map>
+
+#include "AllocationCounter.hpp"
+#include "ScalingProfile.hpp"
+#include "AxisSpec.hpp"
+#include "ChunkPool.hpp"
+#include "Checkpoint.hpp"
+#include "EventSampler.hpp"
+#include "PidMatchingCuts.hpp"
+
 class PidMatching : public UserFillTask {
 
  public:
@@ -33,6 +44,32 @@ class PidMatching : public UserFillTask {
   struct ValidateEfficiencyStruct;
 
   void InitEfficiencies();
+  /* upper estimate of the memory taken by the QA histograms, bytes */
+  size_t EstimateEfficienciesMemory(const AxisSpec &mult_axis,
+                                    const AxisSpec &y_axis,
+                                    const AxisSpec &eta_axis,
+                                    const AxisSpec &pt_axis) const;
+  /* worst over species of the precision reached in convergence_fraction of populated bins */
+  double EvalAchievedPrecision() const;
+  void CheckConvergence();
+  /* the remaining events are neither read nor written once all instances converged */
+  void StopOutput();
+  /* true if all top-level branches of the output tree are written by PidMatching instances */
+  bool OwnsOutputTree() const;
+  void SetOutputBranchStatus(bool status);
+  /* entries before output_begin_entry are skipped, the output of a resumed run starts there */
+  void SuspendOutput();
+  void BeginOutput();
+
+  /* raw accumulators of the QA keyed by '<directory>/<name>', except sparse maps */
+  std::vector<std::pair<std::string, TObject *>> GetAccumulators() const;
+  /* copies of the accumulators, sparse maps are densified */
+  CheckpointWriter::Snapshot MakeSnapshot() const;
+  void WriteCheckpoint();
+  /* input files and the counters are validated, entries before the stored position are not accounted */
+  void LoadCheckpoint(const std::string &path);
+  /* names of the input files, one per line */
+  std::string GetInputFileList() const;
 
   AnalysisTree::Matching *matching_ptr_{nullptr};
   ATI2::Branch *vtxt_branch{nullptr};
@@ -46,13 +83,126 @@ class PidMatching : public UserFillTask {
   static bool opts_loaded;
   static std::string qa_file_name;
   static bool save_canvases;
+  static unsigned int plot_threads;
+  static bool sparse_centrality_maps;
+  static std::vector<int> species;
+  static std::string mult_axis_definition;
+  static std::string y_axis_definition;
+  static std::string eta_axis_definition;
+  static std::string pt_axis_definition;
+  static double memory_budget_mb;
+  static double convergence_precision;
+  static double convergence_fraction;
+  static unsigned int convergence_check_interval;
+  static unsigned int sample_every;
+  static Long64_t sample_events;
+  static uint64_t sample_seed;
+  static std::string sample_event_id;
+  EventSampler sampler_;
+
+  /* instances sharing the output tree, it is not filled anymore once all of them converged */
+  static int n_instances;
+  static int n_converged_instances;
+  static bool output_stopped;
+  /* the output tree is cut at n_output_entries in UserFinish */
+  static bool output_cut;
+  static Long64_t n_output_entries;
+  /* earliest resume entry of the instances */
+  static Long64_t output_begin_entry;
+  static bool output_suspended;
+  /* top-level output branches of all instances */
+  static std::set<std::string> output_branch_names;
+  /* owner of the input branches in InputReadSet, released on convergence */
+  static constexpr const char *kReadSetOwner = "PidMatching";
+  size_t n_events_{0};
+  bool converged_{false};
+
+  static unsigned int checkpoint_interval;
+  static std::string checkpoint_prefix;
+  static bool resume;
+
+  /* SimTracksProc output */
+  enum class SimTracksProcFilter { kAll, kNone, kPrimary, kSpecies };
+  static std::string sim_tracks_proc_mode;
+  static std::vector<int> sim_tracks_proc_species;
+  SimTracksProcFilter sim_tracks_proc_filter_{SimTracksProcFilter::kAll};
+  std::set<int> sim_tracks_proc_pdgs_;
+  std::unique_ptr<CheckpointWriter> checkpoint_writer_;
+  /* entries before this one were accounted in the checkpoint */
+  Long64_t resume_entry_{0};
   static std::string validate_file;
+  static std::string output_profile_name;
+  static std::vector<std::string> float_precision_definitions;
+  static bool count_allocations;
+  static bool profile_scaling;
+  static size_t profile_scaling_max_tracks;
+
+  /* intra-event parallelism */
+  static unsigned int event_threads;
+  static unsigned int event_chunk_size;
+  static std::unique_ptr<ChunkPool> event_pool;
+  /* per-track results of the parallel loops, replayed serially in the order of the tracks */
+  struct MatchedTrackResult {
+    int pdg{0};
+    int sim_mother_id{0};
+    bool is_good_vtx{false};
+    int nhits_vtpc{0};
+    float nhits_ratio{0.};
+    double mass{0.};
+    double y_cm{0.};
+    double pt{0.};
+    double sim_y_cm{0.};
+    double sim_pt{0.};
+    double sim_phi{0.};
+    double weight_msim_sim{0.};
+    double weight_vtx_sim{0.};
+  };
+  struct SimTrackResult {
+    bool is_selected{false};
+    bool write_proc{false};
+    bool has_matched_vtx_track{false};
+    double y_cm{0.};
+    double pt{0.};
+  };
+  struct VtxTrackResult {
+    bool has_matching_sim_track{false};
+    int charge{0};
+    double eta{0.};
+    double pt{0.};
+  };
+  /* PdgHelper is called only from the main thread */
+  std::unordered_map<int, double> mass_cache_;
+  std::vector<int> sim_pdgs_;
+  std::vector<char> vtx_is_good_;
+  std::vector<std::pair<int, int>> matches_;
+  std::vector<MatchedTrackResult> matched_results_;
+  std::vector<SimTrackResult> sim_results_;
+  std::vector<VtxTrackResult> vtx_results_;
+  static bool prune_input;
+
+  AllocationStats allocation_stats_;
+  ScalingProfile scaling_profile_;
+
+  /* output schema */
+  bool write_nhits_ratio_{true};
+  float y_cm_precision_{0.};
+  float nhits_ratio_precision_{0.};
+  float sim_y_cm_precision_{0.};
+  float sim_pt_precision_{0.};
+  float sim_phi_precision_{0.};
 
   TFile *qa_file_{nullptr};
 
  protected:
-  virtual bool CheckSimTrack(const ATI2::BranchChannel &sim_track) const = 0;
-  virtual bool CheckVtxTrack(const ATI2::BranchChannel &vtx_track) const = 0;
+  /* resolves the variables of the cut policy */
+  virtual void InitCuts(ATI2::Branch *vtx_branch, ATI2::Branch *sim_branch) = 0;
+  /* calls ExecEvent with the cut policy */
+  virtual void ExecWithCuts(bool accumulate) = 0;
+  /* matching and QA of one event, the cuts are inlined into the track loops.
+   * Per-track results are computed in chunks run by event_pool and replayed serially.
+   * Without accumulate only the output branches are filled */
+  template<typename CutPolicy>
+  void ExecEvent(const CutPolicy &cuts, bool accumulate);
 
   ATI2::Variable vtxt_dca_x_;
   ATI2::Variable vtxt_dca_y_;
@@ -80,51 +230,37 @@ class PidMatching : public UserFillTask {
   ATI2::Variable sim_mother_id_;
   ATI2::Variable sim_pdg_;
 
-  ATI2::Branch *simtproc_branch;
+  ATI2::Branch *simtproc_branch{nullptr};
   ATI2::Variable simtproc_y_cm;
 };
 
-class PidMatching_NoCuts : public PidMatching {
+/**
+ * @brief PidMatching with the track selection of the CutPolicy (see PidMatchingCuts.hpp)
+ * compiled into the event loop
+ */
+template<typename CutPolicy>
+class PidMatchingWithCuts : public PidMatching {
  protected:
-  bool CheckSimTrack(const ATI2::BranchChannel &sim_track) const override {
-    return sim_track[sim_mother_id_].GetInt() == -1;
+  void InitCuts(ATI2::Branch *vtx_branch, ATI2::Branch *sim_branch) override {
+    cuts_.Init(vtx_branch, sim_branch);
   }
-  bool CheckVtxTrack(const ATI2::BranchChannel &vtx_track) const override {
-    return true;
+  void ExecWithCuts(bool accumulate) override {
+    ExecEvent(cuts_, accumulate);
   }
- TASK_DEF(PidMatching_NoCuts, 0);
-};
 
-class PidMatching_StandardCuts : public PidMatching {
- protected:
-  bool CheckSimTrack(const ATI2::BranchChannel &sim_track) const override {
-    return sim_track[sim_mother_id_].GetInt() == -1;
-  }
-  bool CheckVtxTrack(const ATI2::BranchChannel &vtx_track) const override {
-    int nhits_total =
-        vtx_track[vtxt_nhits_vtpc1_].GetInt() +
-        vtx_track[vtxt_nhits_vtpc2_].GetInt() +
-        vtx_track[vtxt_nhits_mtpc_].GetInt();
-    int nhits_vtpc =
-        vtx_track[vtxt_nhits_vtpc1_].GetInt() +
-        vtx_track[vtxt_nhits_vtpc2_].GetInt();
-    int nhits_pot_total =
-        vtx_track[vtxt_nhits_pot_vtpc1_].GetInt() +
-        vtx_track[vtxt_nhits_pot_vtpc2_].GetInt() +
-        vtx_track[vtxt_nhits_pot_mtpc_].GetInt();
-    float ratio_nhits_nhits_pot = float(nhits_total) / float(nhits_pot_total);
-
-    auto dca_x = vtx_track[vtxt_dca_x_];
-    auto dca_y = vtx_track[vtxt_dca_y_];
-
-
-    return
-      nhits_total > 30 && nhits_vtpc > 15 &&
-      nhits_pot_total > 0 &&
-      ratio_nhits_nhits_pot > 0.55 && ratio_nhits_nhits_pot < 1.1 &&
-      abs(dca_x) < 2. && abs(dca_y) < 1.;
-  }
- TASK_DEF(PidMatching_StandardCuts, 0);
+  CutPolicy cuts_;
 };
 
+#define PID_MATCHING_TASK_DEF(TASK_NAME, CUT_POLICY) \
+  class TASK_NAME : public PidMatchingWithCuts<CUT_POLICY> { \
+   TASK_DEF(TASK_NAME, 0) \
+  };
+/* to be placed after the definition of PidMatching::ExecEvent, one task per policy */
+#define PID_MATCHING_TASK_IMPL(TASK_NAME, CUT_POLICY) \
+  template void PidMatching::ExecEvent<CUT_POLICY>(const CUT_POLICY &, bool); \
+  TASK_IMPL(TASK_NAME)
+
+PID_MATCHING_TASK_DEF(PidMatching_NoCuts, NoCutsPolicy)
+PID_MATCHING_TASK_DEF(PidMatching_StandardCuts, StandardCutsPolicy)
+
 #endif //ATPIDTASK_PID_MATCHING_PIDMATCHING_HPP_
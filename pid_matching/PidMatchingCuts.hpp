@@ -0,0 +1,72 @@
+//
+// Created by eugene on 16/04/2021.
+//
+
+#ifndef ATPIDTASK_PID_MATCHING_PIDMATCHINGCUTS_HPP_
+#define ATPIDTASK_PID_MATCHING_PIDMATCHINGCUTS_HPP_
+
+#include <ati2/ATI2.hpp>
+
+#include <tuple>
+
+#include "VtxTrackCut.hpp"
+
+/**
+ * Cut policies of PidMatching. A policy is a plain class with
+ *   void Init(ATI2::Branch *vtx_branch, ATI2::Branch *sim_branch);
+ *   bool CheckSimTrack(const ATI2::BranchChannel &sim_track) const;
+ *   bool CheckVtxTrack(const ATI2::BranchChannel &vtx_track) const;
+ * the checks are inlined into the track loops of PidMatching::ExecEvent.
+ * A new variant is registered as a task with
+ *   PID_MATCHING_TASK_DEF(<task name>, <policy>) in PidMatching.hpp and
+ *   PID_MATCHING_TASK_IMPL(<task name>, <policy>) in PidMatching.cpp
+ */
+
+/* primary sim tracks only */
+struct PrimarySimTrackCut {
+  ATI2::Variable v_mother_id;
+
+  void InitBranch(ATI2::Branch *sim_branch) {
+    std::tie(v_mother_id) = sim_branch->GetVars("mother_id");
+  }
+
+  bool CheckSimTrack(const ATI2::BranchChannel &sim_track) const {
+    return sim_track[v_mother_id].GetInt() == -1;
+  }
+};
+
+struct NoCutsPolicy {
+  PrimarySimTrackCut sim_track_cut;
+
+  void Init(ATI2::Branch *, ATI2::Branch *sim_branch) {
+    sim_track_cut.InitBranch(sim_branch);
+  }
+
+  bool CheckSimTrack(const ATI2::BranchChannel &sim_track) const {
+    return sim_track_cut.CheckSimTrack(sim_track);
+  }
+
+  bool CheckVtxTrack(const ATI2::BranchChannel &) const {
+    return true;
+  }
+};
+
+struct StandardCutsPolicy {
+  PrimarySimTrackCut sim_track_cut;
+  VtxTrackCut vtx_track_cut{VtxTrackCut::Standard()};
+
+  void Init(ATI2::Branch *vtx_branch, ATI2::Branch *sim_branch) {
+    sim_track_cut.InitBranch(sim_branch);
+    vtx_track_cut.InitBranch(vtx_branch);
+  }
+
+  bool CheckSimTrack(const ATI2::BranchChannel &sim_track) const {
+    return sim_track_cut.CheckSimTrack(sim_track);
+  }
+
+  bool CheckVtxTrack(const ATI2::BranchChannel &vtx_track) const {
+    return vtx_track_cut.CheckVtxTrack(vtx_track);
+  }
+};
+
+#endif //ATPIDTASK_PID_MATCHING_PIDMATCHINGCUTS_HPP_
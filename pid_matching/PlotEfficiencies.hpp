@@ -11,74 +11,189 @@
 #include <TKey.h>
 #include <TStyle.h>
 #include <TCanvas.h>
+#include <TROOT.h>
 
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
 #include <regex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Projects efficiencies using n_threads workers (0 - number of cores).
+ * Results are in the order of the input.
+ */
+inline std::vector<std::unique_ptr<TList>>
+ProjectEfficiencies(const std::vector<TEfficiency *> &efficiencies, unsigned int n_threads = 0) {
+  std::vector<std::unique_ptr<TList>> projections(efficiencies.size());
+
+  if (n_threads == 0)
+    n_threads = std::max(1u, std::thread::hardware_concurrency());
+  n_threads = std::min<unsigned int>(n_threads, efficiencies.size());
+
+  if (n_threads <= 1) {
+    for (size_t i_eff = 0; i_eff < efficiencies.size(); ++i_eff) {
+      projections[i_eff].reset(ProjectEfficiency(efficiencies[i_eff]));
+    }
+    return projections;
+  }
 
-inline void ProcessEfficiencyDir(TDirectory *dir) {
-  dir->cd();
-
-  TList *key_list = dir->GetListOfKeys();
-  for (Int_t ik = 0; ik < key_list->GetEntries(); ++ik) {
-    TKey *key = (TKey *) key_list->At(ik);
+  ROOT::EnableThreadSafety();
+  /* projections are never attached to the (thread-local) gDirectory */
+  const bool add_directory_status = TH1::AddDirectoryStatus();
+  TH1::AddDirectory(false);
+
+  std::atomic<size_t> next_eff{0};
+  std::vector<std::thread> workers;
+  for (unsigned int i_thread = 0; i_thread < n_threads; ++i_thread) {
+    workers.emplace_back([&]() {
+      for (size_t i_eff = next_eff++; i_eff < efficiencies.size(); i_eff = next_eff++) {
+        projections[i_eff].reset(ProjectEfficiency(efficiencies[i_eff]));
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
 
-    if(TClass::GetClass(key->GetClassName()) == TEfficiency::Class()) {
-      TList * obj_list = ProjectEfficiency((TEfficiency *) key->ReadObj());
+  TH1::AddDirectory(add_directory_status);
+  return projections;
+}
 
-      for (Int_t io = 0; io < obj_list->GetEntries(); ++io) {
-        TObject *o = obj_list->At(io);
-        o->Write(o->GetName(), TObject::kOverwrite);
-      }
-    }
+/**
+ * @brief Ratios and residues of the centrality slices to the centrality-integrated efficiency.
+ * Works on the in-memory projections of the directory, new objects are appended to 'objects'
+ */
+inline void ProcessEfficiencyRatios(TDirectory *dir,
+                                    std::vector<TObject *> &objects,
+                                    std::vector<std::unique_ptr<TObject>> &owned_objects) {
+  std::map<std::string, TObject *> objects_by_name;
+  for (auto o : objects) {
+    objects_by_name.emplace(o->GetName(), o);
   }
+  auto find_profile = [&objects_by_name](const std::string &name) -> TProfile2D * {
+    auto it = objects_by_name.find(name);
+    return it == objects_by_name.end() ? nullptr : dynamic_cast<TProfile2D *>(it->second);
+  };
 
-  TProfile2D * msim_sim_y_pt_prof = dynamic_cast<TProfile2D*>(gDirectory->Get("matched_sim_sim_y_pt_prof"));
-  key_list = dir->GetListOfKeys();
+  TProfile2D * msim_sim_y_pt_prof = find_profile("matched_sim_sim_y_pt_prof");
 
   gStyle->SetOptStat(0);
-  auto c_ratio = new TCanvas;
+  auto c_ratio = std::make_unique<TCanvas>();
   std::string efficiency_ratio_pdf_name{Form("efficiency_ratio_%s.pdf", dir->GetName())};
   c_ratio->SetCanvasSize(800,600);
   c_ratio->SetBatch(true);
   c_ratio->Print((efficiency_ratio_pdf_name + "(").c_str(), "pdf");
 
-  for (Int_t ik = 0; ik < key_list->GetEntries(); ++ik) {
-    TKey *key = (TKey *) key_list->At(ik);
-    const std::regex re_expr("^matched_sim_sim_centr_y_pt_(\\d+)$");
+  const std::regex re_expr("^matched_sim_sim_centr_y_pt_(\\d+)$");
+  const size_t n_projections = objects.size();
+  for (size_t io = 0; io < n_projections; ++io) {
     std::smatch match_results;
-    std::string key_name{key->GetName()};
+    std::string obj_name{objects[io]->GetName()};
 
-    if (std::regex_search(key_name, match_results, re_expr)) {
+    if (msim_sim_y_pt_prof && std::regex_search(obj_name, match_results, re_expr)) {
       auto centrality_class = match_results.str(1);
-      TProfile2D *ratio_msim_sim_centr_bin_avg = dynamic_cast<TProfile2D*>(key->ReadObj()->
+      TProfile2D *ratio_msim_sim_centr_bin_avg = dynamic_cast<TProfile2D*>(objects[io]->
           Clone(Form("ratio_msim_sim_y_pt_centr_%s_total", centrality_class.c_str())));
       ratio_msim_sim_centr_bin_avg->Divide(msim_sim_y_pt_prof);
       ratio_msim_sim_centr_bin_avg->SetTitle(Form("Ratio {%s} / {%s}", ratio_msim_sim_centr_bin_avg->GetTitle(), msim_sim_y_pt_prof->GetTitle()));
       ratio_msim_sim_centr_bin_avg->SetMinimum(0.9);
       ratio_msim_sim_centr_bin_avg->SetMaximum(1.1);
-      ratio_msim_sim_centr_bin_avg->Write();
+      owned_objects.emplace_back(ratio_msim_sim_centr_bin_avg);
+      objects.push_back(ratio_msim_sim_centr_bin_avg);
 
       c_ratio->cd();
       c_ratio->Clear();
       ratio_msim_sim_centr_bin_avg->DrawClone("colz");
       c_ratio->Print(efficiency_ratio_pdf_name.c_str(), "pdf");
 
-
-
       /* lookup vtx_sim_centr_y_pt_%d */
-      TProfile2D *residue_vtx_sim_y_pt_centr_bin = dynamic_cast<TProfile2D*>(dir->Get(Form("vtx_sim_centr_y_pt_%s", centrality_class.c_str()))
+      auto vtx_sim_centr_bin = find_profile(Form("vtx_sim_centr_y_pt_%s", centrality_class.c_str()));
+      if (!vtx_sim_centr_bin)
+        continue;
+      TProfile2D *residue_vtx_sim_y_pt_centr_bin = dynamic_cast<TProfile2D*>(vtx_sim_centr_bin
           ->Clone(Form("residue_vtx_msim_centr_y_pt_%s", centrality_class.c_str())));
       residue_vtx_sim_y_pt_centr_bin->Add(msim_sim_y_pt_prof, -1.);
       residue_vtx_sim_y_pt_centr_bin->SetTitle("N (VtxTracks) - N (Matched SimTracks) / N (SimTracks)");
       residue_vtx_sim_y_pt_centr_bin->SetMinimum(-0.2);
       residue_vtx_sim_y_pt_centr_bin->SetMaximum(0.2);
-      residue_vtx_sim_y_pt_centr_bin->Write();
+      owned_objects.emplace_back(residue_vtx_sim_y_pt_centr_bin);
+      objects.push_back(residue_vtx_sim_y_pt_centr_bin);
     }
-  } // keys
+  } // projections
 
   c_ratio->Print((efficiency_ratio_pdf_name + ")").c_str(), "pdf");
 }
 
-inline void PlotEfficiencies(const char *filename) {
+/* output directory and the in-memory efficiencies to be projected into it */
+using EfficiencyDirSpec = std::pair<TDirectory *, std::vector<TEfficiency *>>;
+
+/**
+ * @brief Projections are computed in parallel from the in-memory objects,
+ * processed further and written once in the order of directories and efficiencies
+ */
+inline void ProcessEfficiencies(const std::vector<EfficiencyDirSpec> &specs, unsigned int n_threads = 0) {
+  std::vector<TEfficiency *> efficiencies;
+  std::vector<size_t> efficiency_dir_ids;
+  for (size_t i_dir = 0; i_dir < specs.size(); ++i_dir) {
+    for (auto eff : specs[i_dir].second) {
+      efficiencies.push_back(eff);
+      efficiency_dir_ids.push_back(i_dir);
+    }
+  }
+
+  auto projections = ProjectEfficiencies(efficiencies, n_threads);
+
+  std::vector<std::vector<TObject *>> dir_objects(specs.size());
+  for (size_t i_eff = 0; i_eff < projections.size(); ++i_eff) {
+    for (auto o : *projections[i_eff]) {
+      dir_objects[efficiency_dir_ids[i_eff]].push_back(o);
+    }
+  }
+
+  auto cwd = gDirectory;
+  for (size_t i_dir = 0; i_dir < specs.size(); ++i_dir) {
+    auto dir = specs[i_dir].first;
+    std::vector<std::unique_ptr<TObject>> owned_objects;
+    ProcessEfficiencyRatios(dir, dir_objects[i_dir], owned_objects);
+
+    dir->cd();
+    for (auto o : dir_objects[i_dir]) {
+      o->Write(o->GetName(), TObject::kOverwrite);
+    }
+  }
+  cwd->cd();
+}
+
+/**
+ * @brief Same as ProcessEfficiencies() for the efficiencies already written to the directories
+ */
+inline void ProcessEfficiencyDirs(const std::vector<TDirectory *> &dirs, unsigned int n_threads = 0) {
+  std::vector<std::unique_ptr<TEfficiency>> efficiencies;
+  std::vector<EfficiencyDirSpec> specs;
+  for (auto dir : dirs) {
+    specs.emplace_back(dir, std::vector<TEfficiency *>{});
+    TList *key_list = dir->GetListOfKeys();
+    for (Int_t ik = 0; ik < key_list->GetEntries(); ++ik) {
+      TKey *key = (TKey *) key_list->At(ik);
+      if (TClass::GetClass(key->GetClassName()) == TEfficiency::Class()) {
+        auto eff = (TEfficiency *) key->ReadObj();
+        eff->SetDirectory(nullptr);
+        efficiencies.emplace_back(eff);
+        specs.back().second.push_back(eff);
+      }
+    }
+  }
+  ProcessEfficiencies(specs, n_threads);
+}
+
+inline void ProcessEfficiencyDir(TDirectory *dir) {
+  ProcessEfficiencyDirs({dir});
+}
+
+inline void PlotEfficiencies(const char *filename, unsigned int n_threads = 0) {
   TFile f(filename, "UPDATE");
   if (f.IsZombie()) {
     std::cout << "f::IsZombie()" << std::endl;
@@ -87,6 +202,7 @@ inline void PlotEfficiencies(const char *filename) {
 
   const std::regex re_expr("^efficiency_.*$");
 
+  std::vector<TDirectory *> dirs;
   TList *key_list = f.GetListOfKeys();
   for (Int_t ik = 0; ik < key_list->GetEntries(); ++ik) {
     TKey * key = (TKey *) key_list->At(ik);
@@ -94,9 +210,10 @@ inline void PlotEfficiencies(const char *filename) {
     if (TClass::GetClass(key->GetClassName())->InheritsFrom(TDirectory::Class()) &&
         std::regex_match(key->GetName(), re_expr)) {
       std::cout << "Processing '" << key->GetName() << "'..." << std::endl;
-      ProcessEfficiencyDir((TDirectory *) key->ReadObj());
+      dirs.push_back((TDirectory *) key->ReadObj());
     }
   } // keys
+  ProcessEfficiencyDirs(dirs, n_threads);
 
   f.Close();
 
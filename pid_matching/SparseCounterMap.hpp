@@ -0,0 +1,126 @@
+//
+// Created by eugene on 29/03/2021.
+//
+
+#ifndef ATPIDTASK_PID_MATCHING_SPARSECOUNTERMAP_HPP_
+#define ATPIDTASK_PID_MATCHING_SPARSECOUNTERMAP_HPP_
+
+#include <TAxis.h>
+#include <TH3.h>
+#include <TEfficiency.h>
+
+#include <array>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Pair of 3D counters on the TH3 binning which stores only non-empty cells.
+ *
+ * Replaces dense TH3 / 3D TEfficiency accumulators, which are mostly empty
+ * outside the acceptance. ROOT objects are created only on densification.
+ */
+class SparseCounterMap {
+ public:
+  SparseCounterMap(const TAxis &x_axis, const TAxis &y_axis, const TAxis &z_axis) :
+      x_axis_(x_axis), y_axis_(y_axis), z_axis_(z_axis) {}
+
+  void Fill(int i_counter, double x, double y, double z, double w = 1.) {
+    auto &cell = cells_[GlobalBin(x, y, z)];
+    cell[i_counter] += w;
+    ++n_entries_[i_counter];
+  }
+
+  /* counter 0 - passed, counter 1 - total */
+  void FillEfficiency(bool passed, double x, double y, double z) {
+    auto &cell = cells_[GlobalBin(x, y, z)];
+    if (passed) {
+      cell[0] += 1.;
+      ++n_entries_[0];
+    }
+    cell[1] += 1.;
+    ++n_entries_[1];
+  }
+
+  bool HasSameBinning(const TH1 &histo) const {
+    return histo.GetDimension() == 3 &&
+        histo.GetXaxis()->GetNbins() == x_axis_.GetNbins() &&
+        histo.GetYaxis()->GetNbins() == y_axis_.GetNbins() &&
+        histo.GetZaxis()->GetNbins() == z_axis_.GetNbins();
+  }
+
+  /* adds the contents of the histogram with the same binning, e.g. from ToTH3() */
+  void AddCounters(int i_counter, const TH1 &histo) {
+    for (int i_cell = 0; i_cell < histo.GetNcells(); ++i_cell) {
+      auto content = histo.GetBinContent(i_cell);
+      if (content != 0.)
+        cells_[i_cell][i_counter] += content;
+    }
+    n_entries_[i_counter] += size_t(histo.GetEntries());
+  }
+
+  void AddEfficiency(const TEfficiency &efficiency) {
+    AddCounters(0, *efficiency.GetPassedHistogram());
+    AddCounters(1, *efficiency.GetTotalHistogram());
+  }
+
+  size_t GetNCells() const { return cells_.size(); }
+
+  /* approximate memory footprint of the hash table */
+  size_t GetMemoryBytes() const {
+    return cells_.bucket_count() * sizeof(void *) +
+        cells_.size() * (sizeof(Cell) + sizeof(long) + 2 * sizeof(void *));
+  }
+
+  TH3D *ToTH3(int i_counter, const char *name, const char *title) const {
+    const auto x_edges = Edges(x_axis_);
+    const auto y_edges = Edges(y_axis_);
+    const auto z_edges = Edges(z_axis_);
+    auto histo = new TH3D(name, title,
+                          x_axis_.GetNbins(), x_edges.data(),
+                          y_axis_.GetNbins(), y_edges.data(),
+                          z_axis_.GetNbins(), z_edges.data());
+    for (auto &&[bin, cell] : cells_) {
+      histo->SetBinContent(int(bin), cell[i_counter]);
+    }
+    histo->SetEntries(double(n_entries_[i_counter]));
+    return histo;
+  }
+
+  TEfficiency *ToEfficiency(const char *name, const char *title) const {
+    std::unique_ptr<TH3D> passed(ToTH3(0, "passed", title));
+    std::unique_ptr<TH3D> total(ToTH3(1, "total", title));
+    passed->SetDirectory(nullptr);
+    total->SetDirectory(nullptr);
+    auto efficiency = new TEfficiency(*passed, *total);
+    efficiency->SetName(name);
+    efficiency->SetTitle(title);
+    return efficiency;
+  }
+
+ private:
+  using Cell = std::array<double, 2>;
+
+  static std::vector<double> Edges(const TAxis &axis) {
+    std::vector<double> edges(axis.GetNbins() + 1);
+    for (int i_bin = 0; i_bin <= axis.GetNbins(); ++i_bin) {
+      edges[i_bin] = axis.GetBinLowEdge(i_bin + 1);
+    }
+    return edges;
+  }
+
+  long GlobalBin(double x, double y, double z) const {
+    const long ix = x_axis_.FindFixBin(x);
+    const long iy = y_axis_.FindFixBin(y);
+    const long iz = z_axis_.FindFixBin(z);
+    return ix + (x_axis_.GetNbins() + 2) * (iy + long(y_axis_.GetNbins() + 2) * iz);
+  }
+
+  TAxis x_axis_;
+  TAxis y_axis_;
+  TAxis z_axis_;
+  std::unordered_map<long, Cell> cells_;
+  std::array<size_t, 2> n_entries_{0, 0};
+};
+
+#endif //ATPIDTASK_PID_MATCHING_SPARSECOUNTERMAP_HPP_
@@ -12,97 +12,225 @@
 #include <TProfile2D.h>
 #include <TProfile.h>
 #include <TAxis.h>
+#include <TArrayD.h>
+#include <TArrayF.h>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace Details {
+
+/* bin contents in the order of global bins, copied at once from the underlying array */
+inline std::vector<double> ReadBinContents(const TH1 &histo) {
+  const auto n_cells = size_t(histo.GetNcells());
+  std::vector<double> contents(n_cells);
+  if (auto array_d = dynamic_cast<const TArrayD *>(&histo)) {
+    std::copy(array_d->GetArray(), array_d->GetArray() + n_cells, contents.begin());
+  } else if (auto array_f = dynamic_cast<const TArrayF *>(&histo)) {
+    std::copy(array_f->GetArray(), array_f->GetArray() + n_cells, contents.begin());
+  } else {
+    for (size_t i_cell = 0; i_cell < n_cells; ++i_cell) {
+      contents[i_cell] = histo.GetBinContent(int(i_cell));
+    }
+  }
+  return contents;
+}
+
+/* passed / total, 0 for empty bins. Branch-free to let the compiler vectorize it */
+inline void ComputeEfficiencies(const double *passed, const double *total, double *efficiency, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    efficiency[i] = passed[i] / (total[i] > 0. ? total[i] : 1.);
+  }
+}
+
+/* efficiencies of all global bins */
+inline std::vector<double> ReadEfficiencies(const TEfficiency &eff,
+                                            const std::vector<double> &passed,
+                                            const std::vector<double> &total) {
+  std::vector<double> efficiency(passed.size());
+  if (eff.UsesBayesianStat() || eff.UsesWeights()) {
+    /* estimate is not a simple ratio */
+    for (size_t i_cell = 0; i_cell < passed.size(); ++i_cell) {
+      efficiency[i_cell] = eff.GetEfficiency(int(i_cell));
+    }
+  } else {
+    ComputeEfficiencies(passed.data(), total.data(), efficiency.data(), passed.size());
+  }
+  return efficiency;
+}
+
+/* the profile has exactly one entry with given value in the bin, same as after Fill() */
+template<typename Profile>
+inline void SetProfileBin(Profile *profile, Int_t bin, Double_t value) {
+  profile->SetBinEntries(bin, 1.);
+  profile->SetBinContent(bin, value);
+  (*profile->GetSumw2())[bin] = value * value;
+}
+
+inline TProfile *MakeProfile(const char *name, const char *title, const TAxis *x_axis) {
+  auto profile = x_axis->IsVariableBinSize() ?
+                 new TProfile(name, title, x_axis->GetNbins(), x_axis->GetXbins()->GetArray()) :
+                 new TProfile(name, title, x_axis->GetNbins(), x_axis->GetXmin(), x_axis->GetXmax());
+  profile->SetDirectory(nullptr);
+  profile->GetXaxis()->SetTitle(x_axis->GetTitle());
+  return profile;
+}
+
+inline TProfile2D *MakeProfile2D(const char *name, const char *title, const TAxis *x_axis, const TAxis *y_axis) {
+  TProfile2D *profile;
+  if (x_axis->IsVariableBinSize() || y_axis->IsVariableBinSize()) {
+    std::vector<double> x_edges(x_axis->GetNbins() + 1);
+    std::vector<double> y_edges(y_axis->GetNbins() + 1);
+    for (int i = 0; i <= x_axis->GetNbins(); ++i) x_edges[i] = x_axis->GetBinLowEdge(i + 1);
+    for (int i = 0; i <= y_axis->GetNbins(); ++i) y_edges[i] = y_axis->GetBinLowEdge(i + 1);
+    profile = new TProfile2D(name, title, x_axis->GetNbins(), x_edges.data(), y_axis->GetNbins(), y_edges.data());
+  } else {
+    profile = new TProfile2D(name, title,
+                             x_axis->GetNbins(), x_axis->GetXmin(), x_axis->GetXmax(),
+                             y_axis->GetNbins(), y_axis->GetXmin(), y_axis->GetXmax());
+  }
+  profile->SetDirectory(nullptr);
+  profile->GetXaxis()->SetTitle(x_axis->GetTitle());
+  profile->GetYaxis()->SetTitle(y_axis->GetTitle());
+  profile->SetMinimum(0.);
+  profile->SetMaximum(1.);
+  return profile;
+}
+
+}
+
+/**
+ * @brief Relative statistical uncertainty which is reached in the given fraction
+ * of populated bins. Binomial k out of N: sigma(eps)/eps = sqrt((N - k) / (k N)).
+ * Computed from the raw counters, passed is clamped to total.
+ * Infinity if there are no populated bins.
+ */
+inline double EfficiencyPrecisionQuantile(const TH1 &passed_histo, const TH1 &total_histo, double fraction) {
+  const auto passed = Details::ReadBinContents(passed_histo);
+  const auto total = Details::ReadBinContents(total_histo);
+
+  std::vector<double> rel_errors;
+  rel_errors.reserve(total.size());
+  for (size_t i_cell = 0; i_cell < total.size(); ++i_cell) {
+    const double n = total[i_cell];
+    if (!(n > 0.))
+      continue;
+    const double k = std::min(passed[i_cell], n);
+    rel_errors.push_back(k > 0. ? std::sqrt((n - k) / (k * n)) : std::numeric_limits<double>::infinity());
+  }
+  if (rel_errors.empty())
+    return std::numeric_limits<double>::infinity();
+
+  auto quantile_index = size_t(std::ceil(fraction * double(rel_errors.size())));
+  quantile_index = std::min(std::max(quantile_index, size_t(1)), rel_errors.size()) - 1;
+  std::nth_element(rel_errors.begin(), rel_errors.begin() + quantile_index, rel_errors.end());
+  return rel_errors[quantile_index];
+}
 
+/**
+ * @brief Projects efficiency to the profiles:
+ * 1D - '<name>_prof' TProfile
+ * 2D - '<name>_prof' TProfile2D and TProfile '<name>_<ix>' for every x-bin
+ * 3D - TProfile2D '<name>_<ix>' for every x-bin
+ *
+ * Passed and total contents are read once, efficiencies of all bins are
+ * computed in one pass and bin contents of the profiles are set directly.
+ * Only bins with passed entries are filled.
+ */
 inline
 TList *
 ProjectEfficiency(TEfficiency *eff) {
+  using namespace Details;
+
   auto list = new TList;
   list->SetOwner();
 
-  std::unique_ptr<TH1> total_histo{eff->GetCopyTotalHisto()};
-  std::unique_ptr<TH1> passed_histo{eff->GetCopyPassedHisto()};
+  const TH1 *total_histo = eff->GetTotalHistogram();
+  const TH1 *passed_histo = eff->GetPassedHistogram();
+
+  const auto passed = ReadBinContents(*passed_histo);
+  const auto total = ReadBinContents(*total_histo);
+  const auto efficiency = ReadEfficiencies(*eff, passed, total);
+
+  auto x_axis = total_histo->GetXaxis();
+  auto y_axis = total_histo->GetYaxis();
+  auto z_axis = total_histo->GetZaxis();
+  const int nx = x_axis->GetNbins();
+  const int ny = eff->GetDimension() > 1 ? y_axis->GetNbins() : 0;
+  const int nz = eff->GetDimension() > 2 ? z_axis->GetNbins() : 0;
+  auto global_bin = [nx, ny](int ix, int iy, int iz) {
+    return ix + (nx + 2) * (iy + (ny + 2) * iz);
+  };
 
   if (eff->GetDimension() == 1) {
-    /* Convert to TH1* */
+    auto h1 = MakeProfile(Form("%s_prof", eff->GetName()), eff->GetTitle(), x_axis);
+    h1->SetMinimum(0.);
+    h1->SetMaximum(1.);
+    int n_filled = 0;
+    for (int ix = 1; ix <= nx; ++ix) {
+      auto bin = global_bin(ix, 0, 0);
+      if (passed[bin] > 0) {
+        SetProfileBin(h1, h1->GetBin(ix), efficiency[bin]);
+        ++n_filled;
+      }
+    }
+    h1->SetEntries(n_filled);
+    list->Add(h1);
   } else if (eff->GetDimension() == 2) {
-    /* List of TH1-s */
-    auto x_axis = total_histo->GetXaxis();
-    auto y_axis = total_histo->GetYaxis();
-
     /* export as-is */
-    auto h2 = new TProfile2D(
-        Form("%s_prof", eff->GetName()),
-        eff->GetTitle(),
-        x_axis->GetNbins(), x_axis->GetXmin(), x_axis->GetXmax(),
-        y_axis->GetNbins(), y_axis->GetXmin(), y_axis->GetXmax());
-    h2->SetDirectory(nullptr);
-    h2->GetXaxis()->SetTitle(x_axis->GetTitle());
-    h2->GetYaxis()->SetTitle(y_axis->GetTitle());
-    h2->SetMinimum(0.);
-    h2->SetMaximum(1.);
-
-    for (int ix = 1; ix < x_axis->GetNbins(); ++ix) {
-      for (int iy = 1; iy < y_axis->GetNbins(); ++iy) {
-        auto xc = x_axis->GetBinCenter(ix);
-        auto yc = y_axis->GetBinCenter(iy);
-        bool is_any_passed = passed_histo->GetBinContent(ix, iy) > 0;
-        if (is_any_passed)
-          h2->Fill(xc, yc, eff->GetEfficiency(eff->GetGlobalBin(ix, iy)));
+    auto h2 = MakeProfile2D(Form("%s_prof", eff->GetName()), eff->GetTitle(), x_axis, y_axis);
+    int n_filled = 0;
+    for (int iy = 1; iy <= ny; ++iy) {
+      for (int ix = 1; ix <= nx; ++ix) {
+        auto bin = global_bin(ix, iy, 0);
+        if (passed[bin] > 0) {
+          SetProfileBin(h2, h2->GetBin(ix, iy), efficiency[bin]);
+          ++n_filled;
+        }
       }
     }
+    h2->SetEntries(n_filled);
     list->Add(h2);
 
-    for (int ix = 1; ix < x_axis->GetNbins(); ++ix) {
-      auto h1 = new TProfile(
+    /* List of TH1-s */
+    for (int ix = 1; ix <= nx; ++ix) {
+      auto h1 = MakeProfile(
           Form("%s_%d", eff->GetName(), ix),
           Form("%s;  '%s' bin [%f, %f]", eff->GetTitle(), x_axis->GetTitle(),
                x_axis->GetBinLowEdge(ix), x_axis->GetBinUpEdge(ix)),
-          y_axis->GetNbins(), y_axis->GetXmin(), y_axis->GetXmax());
-      h1->GetXaxis()->SetTitle(y_axis->GetTitle());
-      h1->SetDirectory(nullptr);
-
-      for (int iy = 1; iy < y_axis->GetNbins(); ++iy) {
-        auto yc = y_axis->GetBinCenter(iy);
-
-        bool is_any_passed = passed_histo->GetBinContent(ix, iy) > 0;
-        if (is_any_passed)
-          h1->Fill(yc, eff->GetEfficiency(eff->GetGlobalBin(ix, iy)));
+          y_axis);
+      int n_slice_filled = 0;
+      for (int iy = 1; iy <= ny; ++iy) {
+        auto bin = global_bin(ix, iy, 0);
+        if (passed[bin] > 0) {
+          SetProfileBin(h1, h1->GetBin(iy), efficiency[bin]);
+          ++n_slice_filled;
+        }
       }
-
+      h1->SetEntries(n_slice_filled);
       list->Add(h1);
     }
 
   } else if (eff->GetDimension() == 3) {
     /* List of TH2-s */
-    auto x_axis = total_histo->GetXaxis();
-    auto y_axis = total_histo->GetYaxis();
-    auto z_axis = total_histo->GetZaxis();
-
-    for (int ix = 1; ix < x_axis->GetNbins()+1; ++ix) {
-      auto h2 = new TProfile2D(
+    for (int ix = 1; ix <= nx; ++ix) {
+      auto h2 = MakeProfile2D(
           Form("%s_%d", eff->GetName(), ix),
           Form("%s Bin #%d [%f, %f]", eff->GetTitle(), ix, x_axis->GetBinLowEdge(ix), x_axis->GetBinUpEdge(ix)),
-          y_axis->GetNbins(), y_axis->GetXmin(), y_axis->GetXmax(),
-          z_axis->GetNbins(), z_axis->GetXmin(), z_axis->GetXmax());
-      h2->GetXaxis()->SetTitle(y_axis->GetTitle());
-      h2->GetYaxis()->SetTitle(z_axis->GetTitle());
-      h2->SetDirectory(nullptr);
-      h2->SetMinimum(0.);
-      h2->SetMaximum(1.);
-
-      for (int iy = 1; iy < y_axis->GetNbins(); ++iy) {
-        for (int iz = 1; iz < z_axis->GetNbins(); ++iz) {
-          auto yc = y_axis->GetBinCenter(iy);
-          auto zc = z_axis->GetBinCenter(iz);
-          bool is_any_passed = passed_histo->GetBinContent(ix, iy, iz) > 0;
-          if (is_any_passed) {
-            h2->Fill(yc, zc, eff->GetEfficiency(eff->GetGlobalBin(ix, iy, iz)));
+          y_axis, z_axis);
+      int n_filled = 0;
+      for (int iz = 1; iz <= nz; ++iz) {
+        for (int iy = 1; iy <= ny; ++iy) {
+          auto bin = global_bin(ix, iy, iz);
+          if (passed[bin] > 0) {
+            SetProfileBin(h2, h2->GetBin(iy, iz), efficiency[bin]);
+            ++n_filled;
           }
-
         }
       }
-
+      h2->SetEntries(n_filled);
       list->Add(h2);
     } // ix
   } // ndim == 3
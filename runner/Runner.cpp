@@ -0,0 +1,301 @@
+//
+// Created by eugene on 06/04/2021.
+//
+
+#include "WorkQueue.hpp"
+
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <thread>
+
+namespace {
+
+void ReplaceFirst(std::string &str, const std::string &from, const std::string &to) {
+  auto pos = str.find(from);
+  if (pos != std::string::npos)
+    str.replace(pos, from.size(), to);
+}
+
+bool Merge(std::string command, const std::string &merged, const std::vector<std::string> &inputs) {
+  std::string inputs_str;
+  for (auto &input : inputs) {
+    inputs_str += " " + ShellQuote(input);
+  }
+  ReplaceFirst(command, "{merged}", ShellQuote(merged));
+  ReplaceFirst(command, "{outputs}", inputs_str);
+  std::cout << "Merging: " << command << std::endl;
+  return std::system(command.c_str()) == 0;
+}
+
+/**
+ * @brief Files appearing in the directory. A file is reported once its size
+ * did not change between two polls, hidden files (being transferred) are skipped.
+ */
+class DirectoryWatcher {
+ public:
+  DirectoryWatcher(std::string dir, std::string suffix) : dir_(std::move(dir)), suffix_(std::move(suffix)) {}
+
+  std::vector<std::string> Poll() {
+    namespace fs = std::filesystem;
+    std::vector<std::string> landed;
+    std::set<std::string> present;
+    for (auto &entry : fs::directory_iterator(dir_)) {
+      const auto file_name = entry.path().filename().string();
+      if (!entry.is_regular_file() || file_name.empty() || file_name[0] == '.')
+        continue;
+      if (file_name.size() < suffix_.size() ||
+          file_name.compare(file_name.size() - suffix_.size(), suffix_.size(), suffix_) != 0)
+        continue;
+      const auto path = fs::absolute(entry.path()).string();
+      if (submitted_.count(path))
+        continue;
+
+      const auto size = entry.file_size();
+      present.insert(path);
+      auto size_it = last_size_.find(path);
+      if (size_it != last_size_.end() && size_it->second == size && size > 0) {
+        landed.push_back(path);
+        submitted_.insert(path);
+        last_size_.erase(size_it);
+      } else {
+        last_size_[path] = size;
+      }
+    }
+    /* removed before landing */
+    for (auto it = last_size_.begin(); it != last_size_.end();) {
+      it = present.count(it->first) ? std::next(it) : last_size_.erase(it);
+    }
+    std::sort(landed.begin(), landed.end());
+    return landed;
+  }
+
+  /* non-empty files seen but not reported yet, empty ones can not be told from abandoned */
+  bool HasPending() const {
+    return std::any_of(last_size_.begin(), last_size_.end(), [](auto &&file) { return file.second > 0; });
+  }
+
+ private:
+  std::string dir_;
+  std::string suffix_;
+  std::map<std::string, uintmax_t> last_size_;
+  std::set<std::string> submitted_;
+};
+
+/**
+ * @brief Snapshot of the merged outputs, updated incrementally with the outputs of
+ * the new jobs. Written to a hidden file and renamed, readers never see it half-written.
+ * Every merged file keeps its own count of published jobs, a failed merge of one
+ * of them is retried with the next publication without merging the others twice.
+ */
+class SnapshotPublisher {
+ public:
+  SnapshotPublisher(std::string output_dir, std::vector<std::string> merge_files, std::string merge_command) :
+      output_dir_(std::move(output_dir)),
+      merge_files_(std::move(merge_files)),
+      merge_command_(std::move(merge_command)) {}
+
+  bool HasNew(const WorkQueue &queue) const {
+    const auto n_completed = queue.GetCompleted().size();
+    return std::any_of(merge_files_.begin(), merge_files_.end(), [&](const std::string &merge_file) {
+      return GetNPublished(merge_file) < n_completed;
+    });
+  }
+
+  void Publish(const WorkQueue &queue) {
+    const auto &completed = queue.GetCompleted();
+    for (auto &merge_file : merge_files_) {
+      auto &n_published = n_published_[merge_file];
+      if (n_published == completed.size())
+        continue;
+      const auto snapshot = output_dir_ + "/" + merge_file;
+      const auto tmp_snapshot = output_dir_ + "/.publishing_" + merge_file;
+      std::vector<std::string> inputs;
+      if (n_published > 0)
+        inputs.push_back(snapshot);
+      for (size_t i = n_published; i < completed.size(); ++i) {
+        inputs.push_back(queue.GetJobs()[completed[i]].work_dir + "/" + merge_file);
+      }
+      if (!Merge(merge_command_, tmp_snapshot, inputs) ||
+          std::rename(tmp_snapshot.c_str(), snapshot.c_str()) != 0) {
+        /* retried with the next publication */
+        std::cerr << "Unable to publish '" << snapshot << "'" << std::endl;
+        std::remove(tmp_snapshot.c_str());
+        continue;
+      }
+      n_published = completed.size();
+      std::cout << "Published snapshot of '" << merge_file << "' from " << n_published << " files" << std::endl;
+    }
+  }
+
+ private:
+  size_t GetNPublished(const std::string &merge_file) const {
+    auto it = n_published_.find(merge_file);
+    return it == n_published_.end() ? 0 : it->second;
+  }
+
+  std::string output_dir_;
+  std::vector<std::string> merge_files_;
+  std::string merge_command_;
+  std::map<std::string, size_t> n_published_;
+};
+
+}
+
+/**
+ * @brief Runs one of the task executables over the file list on the local
+ * machine, one input file per job, and optionally merges the outputs.
+ * In the streaming mode the input files are taken from the watched directory as they land,
+ * merged outputs are published periodically.
+ */
+int main(int argc, char **argv) {
+  namespace po = boost::program_options;
+  using Clock = std::chrono::steady_clock;
+
+  std::string file_list;
+  std::string command;
+  std::string output_dir;
+  unsigned int n_workers{0};
+  int max_attempts{2};
+  std::vector<std::string> merge_files;
+  std::string merge_command;
+  bool merge_partial{false};
+
+  std::string watch_dir;
+  std::string watch_suffix;
+  double poll_interval{5.};
+  double publish_interval{60.};
+  std::string stop_file;
+  double idle_timeout{0.};
+
+  po::options_description desc("atpid_runner options");
+  desc.add_options()
+      ("help,h", "Print help")
+      ("file-list,i", po::value(&file_list), "Text file with input files, one per line")
+      ("command,c", po::value(&command)->required(),
+       "Command to run in the job directory. Placeholders: {input}, {filelist}, {job}")
+      ("output-dir,o", po::value(&output_dir)->default_value("runner_output"),
+       "Directory with job directories <output-dir>/job_<id>")
+      ("workers,j", po::value(&n_workers)->default_value(0), "Number of worker processes (0 - number of cores)")
+      ("attempts", po::value(&max_attempts)->default_value(2), "Maximal number of attempts per job")
+      ("merge", po::value(&merge_files)->multitoken(),
+       "Output files of the jobs to merge into <output-dir>/<file> at the end")
+      ("merge-command", po::value(&merge_command)->default_value("hadd -f {merged} {outputs}"),
+       "Merge command. Placeholders: {merged}, {outputs}, substituted single-quoted")
+      ("merge-partial", po::value(&merge_partial)->default_value(false),
+       "Merge outputs of the successful jobs even if some jobs failed")
+      ("watch-dir", po::value(&watch_dir),
+       "Streaming mode: process files landing in this directory instead of the file list")
+      ("watch-suffix", po::value(&watch_suffix)->default_value(".root"), "Streaming mode: suffix of the input files")
+      ("poll-interval", po::value(&poll_interval)->default_value(5.),
+       "Streaming mode: seconds between directory polls")
+      ("publish-interval", po::value(&publish_interval)->default_value(60.),
+       "Streaming mode: minimal seconds between publications of the merged snapshot")
+      ("stop-file", po::value(&stop_file),
+       "Streaming mode: finish once this file exists, all landed files are processed and none is being written")
+      ("idle-timeout", po::value(&idle_timeout)->default_value(0.),
+       "Streaming mode: finish after this number of seconds without new files (0 - never)");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if (vm.count("help")) {
+      std::cout << desc << std::endl;
+      return 0;
+    }
+    po::notify(vm);
+    if (file_list.empty() == watch_dir.empty())
+      throw std::runtime_error("Exactly one of --file-list and --watch-dir is required");
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl << desc << std::endl;
+    return 1;
+  }
+
+  if (n_workers == 0)
+    n_workers = std::max(1u, std::thread::hardware_concurrency());
+
+  WorkQueue queue(command, output_dir, n_workers, max_attempts);
+
+  if (!watch_dir.empty()) {
+    /* streaming */
+    DirectoryWatcher watcher(watch_dir, watch_suffix);
+    SnapshotPublisher publisher(output_dir, merge_files, merge_command);
+    auto last_publish = Clock::now();
+    auto last_input = Clock::now();
+    const auto seconds_since = [](Clock::time_point t) {
+      return std::chrono::duration<double>(Clock::now() - t).count();
+    };
+    std::cout << "Watching " << watch_dir << " with " << n_workers << " workers" << std::endl;
+
+    while (true) {
+      const bool stop_requested = !stop_file.empty() && std::filesystem::exists(stop_file);
+      for (auto &input : watcher.Poll()) {
+        queue.AddInput(input);
+        last_input = Clock::now();
+      }
+      queue.Step(false);
+
+      const bool idle = idle_timeout > 0. && seconds_since(last_input) > idle_timeout;
+      /* files still being written are waited for */
+      const bool finishing = (stop_requested || idle) && queue.IsDone() && !watcher.HasPending();
+      if (publisher.HasNew(queue) && (finishing || seconds_since(last_publish) >= publish_interval)) {
+        publisher.Publish(queue);
+        last_publish = Clock::now();
+      }
+      if (finishing)
+        break;
+      std::this_thread::sleep_for(std::chrono::duration<double>(poll_interval));
+    }
+    queue.PrintSummary(std::cout);
+    return queue.GetNFailed() == 0 ? 0 : 2;
+  }
+
+  {
+    std::ifstream list(file_list);
+    if (!list)
+      throw std::runtime_error("Unable to open file list '" + file_list + "'");
+    std::string line;
+    while (std::getline(list, line)) {
+      if (line.empty() || line[0] == '#')
+        continue;
+      queue.AddInput(line);
+    }
+  }
+  std::cout << "Processing " << queue.GetJobs().size() << " files with " << n_workers << " workers" << std::endl;
+
+  const auto n_failed = queue.Run();
+  queue.PrintSummary(std::cout);
+  {
+    std::ofstream failed_list(output_dir + "/failed.list");
+    for (auto &job : queue.GetJobs()) {
+      if (job.exit_status != 0)
+        failed_list << job.input_file << std::endl;
+    }
+  }
+
+  int exit_code = n_failed == 0 ? 0 : 2;
+  if (merge_files.empty() || (n_failed > 0 && !merge_partial))
+    return exit_code;
+
+  for (auto &merge_file : merge_files) {
+    std::vector<std::string> outputs;
+    for (auto &job : queue.GetJobs()) {
+      if (job.exit_status == 0)
+        outputs.push_back(job.work_dir + "/" + merge_file);
+    }
+    if (!Merge(merge_command, output_dir + "/" + merge_file, outputs)) {
+      std::cerr << "Merge of '" << merge_file << "' failed" << std::endl;
+      exit_code = 3;
+    }
+  }
+  return exit_code;
+}
@@ -0,0 +1,188 @@
+//
+// Created by eugene on 06/04/2021.
+//
+
+#include "WorkQueue.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+void ReplaceAll(std::string &str, const std::string &from, const std::string &to) {
+  for (auto pos = str.find(from); pos != std::string::npos; pos = str.find(from, pos + to.size())) {
+    str.replace(pos, from.size(), to);
+  }
+}
+
+void MakeDir(const std::string &path) {
+  if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST)
+    throw std::runtime_error("Unable to create directory '" + path + "': " + std::strerror(errno));
+}
+
+/* URLs (e.g. root://) are left as they are */
+std::string AbsolutePath(const std::string &path) {
+  if ((!path.empty() && path[0] == '/') || path.find("://") != std::string::npos)
+    return path;
+  char cwd[PATH_MAX];
+  if (!getcwd(cwd, sizeof(cwd)))
+    throw std::runtime_error(std::string("getcwd() failed: ") + std::strerror(errno));
+  return std::string(cwd) + "/" + path;
+}
+
+}
+
+std::string ShellQuote(const std::string &str) {
+  std::string quoted = "'";
+  for (char c : str) {
+    if (c == '\'')
+      quoted += "'\\''";
+    else
+      quoted += c;
+  }
+  return quoted + "'";
+}
+
+WorkQueue::WorkQueue(std::string command, std::string output_dir, unsigned int n_workers, int max_attempts) :
+    command_(std::move(command)),
+    output_dir_(std::move(output_dir)),
+    n_workers_(std::max(n_workers, 1u)),
+    max_attempts_(std::max(max_attempts, 1)) {
+  MakeDir(output_dir_);
+  /* jobs are run in their directories, all paths are made absolute */
+  output_dir_ = AbsolutePath(output_dir_);
+}
+
+void WorkQueue::AddInput(const std::string &input_file) {
+  Job job;
+  job.id = jobs_.size();
+  job.input_file = AbsolutePath(input_file);
+  job.work_dir = output_dir_ + "/job_" + std::to_string(job.id);
+  pending_.push_back(jobs_.size());
+  jobs_.emplace_back(std::move(job));
+}
+
+std::string WorkQueue::MakeCommand(const Job &job) const {
+  auto command = command_;
+  ReplaceAll(command, "{input}", ShellQuote(job.input_file));
+  ReplaceAll(command, "{filelist}", ShellQuote(job.work_dir + "/filelist.txt"));
+  ReplaceAll(command, "{job}", std::to_string(job.id));
+  return command;
+}
+
+pid_t WorkQueue::Start(Job &job) {
+  MakeDir(job.work_dir);
+  {
+    std::ofstream filelist(job.work_dir + "/filelist.txt");
+    filelist << job.input_file << std::endl;
+  }
+  const auto command = MakeCommand(job);
+  const auto log_path = job.work_dir + "/job.log";
+  ++job.n_attempts;
+
+  auto pid = fork();
+  if (pid < 0)
+    throw std::runtime_error(std::string("fork() failed: ") + std::strerror(errno));
+  if (pid == 0) {
+    /* worker */
+    if (chdir(job.work_dir.c_str()) != 0)
+      _exit(127);
+    auto log_fd = open(log_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log_fd >= 0) {
+      dup2(log_fd, STDOUT_FILENO);
+      dup2(log_fd, STDERR_FILENO);
+      close(log_fd);
+    }
+    execl("/bin/sh", "sh", "-c", command.c_str(), static_cast<char *>(nullptr));
+    _exit(127);
+  }
+
+  std::cout << "Job " << job.id << " (attempt " << job.n_attempts << "): " << command << std::endl;
+  return pid;
+}
+
+size_t WorkQueue::Run() {
+  while (!IsDone()) {
+    Step(true);
+  }
+  return GetNFailed();
+}
+
+void WorkQueue::Step(bool wait) {
+  while (!pending_.empty() && running_.size() < n_workers_) {
+    auto i_job = pending_.front();
+    pending_.pop_front();
+    running_.emplace(Start(jobs_[i_job]), std::make_pair(i_job, std::chrono::steady_clock::now()));
+  }
+
+  while (!running_.empty()) {
+    int status = 0;
+    auto pid = waitpid(-1, &status, wait ? 0 : WNOHANG);
+    if (pid == 0)
+      return;
+    if (pid < 0) {
+      if (errno == EINTR)
+        continue;
+      throw std::runtime_error(std::string("waitpid() failed: ") + std::strerror(errno));
+    }
+    auto running_it = running_.find(pid);
+    if (running_it == running_.end())
+      continue;
+
+    const auto [i_job, start_time] = running_it->second;
+    auto &job = jobs_[i_job];
+    job.wall_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+    job.exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    running_.erase(running_it);
+
+    if (job.exit_status == 0) {
+      std::cout << "Job " << job.id << " done in " << job.wall_time << " s" << std::endl;
+      completed_.push_back(i_job);
+    } else if (job.n_attempts < max_attempts_) {
+      std::cout << "Job " << job.id << " failed with status " << job.exit_status << ", retrying" << std::endl;
+      pending_.push_back(i_job);
+    } else {
+      std::cout << "Job " << job.id << " failed with status " << job.exit_status
+                << " after " << job.n_attempts << " attempts" << std::endl;
+    }
+    /* one finished job is enough to start the next one */
+    wait = false;
+  }
+}
+
+size_t WorkQueue::GetNFailed() const {
+  size_t n_failed = 0;
+  for (auto &job : jobs_) {
+    if (job.exit_status != 0)
+      ++n_failed;
+  }
+  return n_failed;
+}
+
+void WorkQueue::PrintSummary(std::ostream &os) const {
+  size_t n_retried = 0;
+  double total_time = 0.;
+  for (auto &job : jobs_) {
+    if (job.n_attempts > 1)
+      ++n_retried;
+    total_time += job.wall_time;
+  }
+  os << "Jobs: " << jobs_.size() << ", retried: " << n_retried
+     << ", total wall time of the workers: " << total_time << " s" << std::endl;
+  for (auto &job : jobs_) {
+    if (job.exit_status != 0) {
+      os << "  FAILED job " << job.id << " (status " << job.exit_status << "): " << job.input_file
+         << ", see " << job.work_dir << "/job.log" << std::endl;
+    }
+  }
+}
@@ -0,0 +1,82 @@
+//
+// Created by eugene on 06/04/2021.
+//
+
+#ifndef ATPIDTASK_RUNNER_WORKQUEUE_HPP_
+#define ATPIDTASK_RUNNER_WORKQUEUE_HPP_
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+
+/* single-quoted for /bin/sh, for the paths substituted into the commands */
+std::string ShellQuote(const std::string &str);
+
+/**
+ * @brief One input file processed by one worker process in its own directory
+ */
+struct Job {
+  size_t id{0};
+  std::string input_file;
+  std::string work_dir;
+  int n_attempts{0};
+  int exit_status{-1};
+  double wall_time{0.};
+};
+
+/**
+ * @brief Dynamic queue of jobs executed by at most n_workers child processes.
+ *
+ * A free worker slot takes the next pending job as soon as any process
+ * finishes, thus long jobs do not block the short ones. Failed jobs are put
+ * back to the end of the queue until max_attempts is reached.
+ *
+ * The command is run with /bin/sh in the job directory, placeholders:
+ *   {input}    - path of the input file
+ *   {filelist} - path of the file list with the single input file
+ *   {job}      - id of the job
+ * Paths are substituted single-quoted and must not be quoted in the command,
+ * local paths are made absolute, URLs are passed as they are.
+ * stdout and stderr go to <job dir>/job.log
+ */
+class WorkQueue {
+ public:
+  WorkQueue(std::string command, std::string output_dir, unsigned int n_workers, int max_attempts);
+
+  void AddInput(const std::string &input_file);
+  /* runs all jobs, returns number of failed ones */
+  size_t Run();
+  /* starts pending jobs and accounts finished ones, waits for at least one if 'wait' is set */
+  void Step(bool wait);
+  bool IsDone() const { return pending_.empty() && running_.empty(); }
+
+  const std::vector<Job> &GetJobs() const { return jobs_; }
+  /* indices of the successful jobs in the order of completion */
+  const std::vector<size_t> &GetCompleted() const { return completed_; }
+  /* failed, or not finished yet */
+  size_t GetNFailed() const;
+  void PrintSummary(std::ostream &os) const;
+
+ private:
+  std::string MakeCommand(const Job &job) const;
+  pid_t Start(Job &job);
+
+  std::string command_;
+  std::string output_dir_;
+  unsigned int n_workers_;
+  int max_attempts_;
+
+  std::vector<Job> jobs_;
+  std::deque<size_t> pending_;
+  std::vector<size_t> completed_;
+  /* pid -> job index and start time */
+  std::map<pid_t, std::pair<size_t, std::chrono::steady_clock::time_point>> running_;
+};
+
+#endif //ATPIDTASK_RUNNER_WORKQUEUE_HPP_
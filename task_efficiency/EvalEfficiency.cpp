@@ -7,18 +7,44 @@
 #include <TFile.h>
 #include <TDirectory.h>
 #include <TKey.h>
+#include <TParameter.h>
 #include <regex>
 #include <boost/lexical_cast.hpp>
 
+#include "InputReadSet.hpp"
+#include "EfficiencyModel.hpp"
+
 TASK_IMPL(EvalEfficiency)
 
+namespace {
+
+/* weight of the particle in the bin of the efficiency */
+float EfficiencyWeight(const TEfficiency &eff_y_pt, int bin, double efficiency_eps_threshold) {
+  auto eff_y_pt_val = eff_y_pt.GetEfficiency(bin);
+  auto err_lo = eff_y_pt.GetEfficiencyErrorLow(bin);
+  auto err_hi = eff_y_pt.GetEfficiencyErrorUp(bin);
+  auto efficiency_eps = (err_hi + err_lo)/eff_y_pt_val;
+  return efficiency_eps < efficiency_eps_threshold ? float(1./eff_y_pt_val) : 1.0f;
+}
+
+}
+
 struct EvalEfficiency::Efficiency {
   TEfficiency *eff_y_pt{nullptr};
+  EfficiencyModel model;
+  /* precomputed weights, used instead of eff_y_pt if valid */
+  SharedTables::GridView weight_grid;
 
   ~Efficiency() {
     delete eff_y_pt;
   }
 
+  float BinnedWeight(float y_cm, float pt, double efficiency_eps_threshold) const {
+    if (weight_grid.IsValid())
+      return weight_grid.Eval(y_cm, pt);
+    return EfficiencyWeight(*eff_y_pt, eff_y_pt->FindFixBin(y_cm, pt), efficiency_eps_threshold);
+  }
+
 };
 
 boost::program_options::options_description EvalEfficiency::GetBoostOptions() {
@@ -39,30 +65,89 @@ boost::program_options::options_description EvalEfficiency::GetBoostOptions() {
           "Name of variable of with transverse momentum")
       ("weight-name", value(&efficiency_field_name_)->default_value("weight_efficiency"),
           "Name of the variable with efficiency weight")
+      ("bypass-branches", value(&bypass_branches_)->default_value(true),
+          "Copy all input branches to the output")
+      ("prune-input", value(&prune_input_)->default_value(false),
+          "Read only the target branch (requires --bypass-branches=false)")
+      ("efficiency-model", value(&use_efficiency_model_)->default_value(false),
+          "Evaluate the fitted model 'vtx_sim_y_pt_model' (see FitEfficiencyModel) instead of the binned efficiency")
+      ("model-min-efficiency", value(&model_min_efficiency_)->default_value(0.05f),
+          "Particles with lower model efficiency or outside of the bins used in the fit get weight 1")
+      ("model-max-chi2ndf", value(&model_max_chi2_ndf_)->default_value(5.),
+          "Species with worse fit of the model, or without the model, use the binned efficiency")
+      ("sample-every", value(&sample_every_)->default_value(1),
+          "Process 1 in N events, selected deterministically by the hash of the event id. "
+          "Unselected events have empty output and the '<task>_sampled' flag unset")
+      ("sample-events", value(&sample_events_)->default_value(0),
+          "Process approximately this number of events (overrides --sample-every)")
+      ("sample-seed", value(&sample_seed_)->default_value(0), "Seed of the event sampling")
+      ("sample-event-id", value(&sample_event_id_)->default_value("RecEventHeader.evt_id"),
+          "Integer field identifying the event for the sampling, <branch>.<field>")
+      ("shared-tables", value(&shared_tables_)->default_value(false),
+          "Share the weight tables with the other processes on the node via POSIX shared memory")
+      ("shared-tables-prefix", value(&shared_tables_prefix_)->default_value("atpid_eval_efficiency"),
+          "Prefix of the shared memory segment name")
       ;
   return desc;
 }
 void EvalEfficiency::PreInit() {
-  LoadEfficiencies();
+  /* the model is a handful of coefficients, not worth sharing */
+  if (shared_tables_ && !use_efficiency_model_)
+    LoadSharedEfficiencies();
+  else
+    LoadEfficiencies();
 }
 void EvalEfficiency::PostFinish() {
   UserTask::PostFinish();
 }
 void EvalEfficiency::UserInit(std::map<std::string, void *> &map) {
-  BypassBranches();
+  if (prune_input_ && bypass_branches_)
+    throw std::runtime_error("--prune-input requires --bypass-branches=false");
+  if (bypass_branches_)
+    BypassBranches();
   /// INPUT
   rec_particles_branch = GetInBranch(target_branch_name_);
 
   /// OUTPUT
   processed_branch = NewBranch(new_branch_name_, rec_particles_branch->GetConfig());
   std::tie(pid_v, y_cm_v, pt_v) = processed_branch->GetVars("pid", var_y_cm_name_, var_pt_name_);
+  if (use_efficiency_model_)
+    std::tie(in_pid_v, in_y_cm_v, in_pt_v) = rec_particles_branch->GetVars("pid", var_y_cm_name_, var_pt_name_);
   weight_v = processed_branch->NewVariable(efficiency_field_name_, FLOAT);
   processed_branch->Freeze();
+
+  sampler_.Configure(sample_events_ > 0 ?
+                     EventSampler::EveryForTarget(in_chain_->GetEntries(), sample_events_) : sample_every_,
+                     sample_seed_);
+  if (sampler_.IsEnabled()) {
+    sampler_.InitEventId(map, *config_, sample_event_id_);
+    sampler_.AddFlagBranch(out_tree_, GetName() + "_sampled");
+  }
+
+  auto &read_set = InputReadSet::Instance();
+  if (prune_input_) {
+    read_set.Declare(target_branch_name_, {var_pid_name_, var_y_cm_name_, var_pt_name_});
+    if (sampler_.IsEnabled())
+      read_set.Declare(sampler_.GetEventIdBranch());
+  } else {
+    read_set.DeclareAll();
+  }
 }
 void EvalEfficiency::UserExec() {
 
+  InputReadSet::Instance().Apply(in_chain_, config_);
 
   processed_branch->ClearChannels();
+
+  /* not selected, flagged in '<task>_sampled' */
+  if (!sampler_.Process())
+    return;
+
+  if (use_efficiency_model_) {
+    ExecModel();
+    return;
+  }
+
   for (auto &rec_particle : rec_particles_branch->Loop()) {
     auto processed_particle = processed_branch->NewChannel();
     processed_particle.CopyContents(rec_particle);
@@ -71,21 +156,68 @@ void EvalEfficiency::UserExec() {
     auto y_cm = processed_particle[y_cm_v].GetVal();
     auto pt = processed_particle[pt_v].GetVal();
 
-    if (efficiencies_.find(pid) != efficiencies_.end()) {
-      auto eff_y_pt = efficiencies_[pid]->eff_y_pt;
-      auto eff_y_pt_val = eff_y_pt->GetEfficiency(eff_y_pt->FindFixBin(y_cm, pt));
-      auto err_lo = eff_y_pt->GetEfficiencyErrorLow(eff_y_pt->FindFixBin(y_cm, pt));
-      auto err_hi = eff_y_pt->GetEfficiencyErrorUp(eff_y_pt->FindFixBin(y_cm, pt));
-      auto efficiency_eps = (err_hi + err_lo)/eff_y_pt_val;
-      auto weight_val = efficiency_eps < efficiency_eps_threshold ? float(1./eff_y_pt_val) : 1.0f;
-      processed_particle[weight_v] = weight_val;
+    auto efficiency_it = efficiencies_.find(pid);
+    if (efficiency_it != efficiencies_.end()) {
+      processed_particle[weight_v] = efficiency_it->second->BinnedWeight(y_cm, pt, efficiency_eps_threshold);
     }
   }
 
 
 
 }
+void EvalEfficiency::ExecModel() {
+  /* gather the kinematics grouped by species, models are evaluated in a batch */
+  for (auto &&[pid, batch] : model_batches_) {
+    batch.Clear();
+  }
+  particle_batches_.clear();
+  for (auto &rec_particle : rec_particles_branch->Loop()) {
+    auto batch_it = model_batches_.find(rec_particle[in_pid_v].GetInt());
+    if (batch_it == model_batches_.end()) {
+      particle_batches_.push_back(nullptr);
+      continue;
+    }
+    auto &batch = batch_it->second;
+    batch.y_cm.push_back(rec_particle[in_y_cm_v].GetVal());
+    batch.pt.push_back(rec_particle[in_pt_v].GetVal());
+    particle_batches_.push_back(&batch);
+  }
+
+  /* outside of the fitted bins the model efficiency is 0, hence the weight is 1 */
+  for (auto &&[pid, batch] : model_batches_) {
+    const auto n = batch.y_cm.size();
+    batch.weight.resize(n);
+    efficiencies_[pid]->model.Eval(batch.y_cm.data(), batch.pt.data(), batch.weight.data(), n);
+    for (auto &weight : batch.weight) {
+      weight = weight > model_min_efficiency_ ? 1.f / weight : 1.0f;
+    }
+  }
+
+  /* particles of every species come in the input order */
+  size_t i_particle = 0;
+  for (auto &rec_particle : rec_particles_branch->Loop()) {
+    auto processed_particle = processed_branch->NewChannel();
+    processed_particle.CopyContents(rec_particle);
+
+    auto batch = particle_batches_[i_particle++];
+    if (batch) {
+      processed_particle[weight_v] = batch->weight[batch->i_next++];
+      continue;
+    }
+    /* species without a usable model */
+    processed_particle[weight_v] = 1.0f;
+    auto efficiency_it = efficiencies_.find(processed_particle[pid_v].GetInt());
+    if (efficiency_it != efficiencies_.end())
+      processed_particle[weight_v] = efficiency_it->second->BinnedWeight(
+          processed_particle[y_cm_v].GetVal(), processed_particle[pt_v].GetVal(), efficiency_eps_threshold);
+  }
+}
+
 void EvalEfficiency::UserFinish() {
+  if (sampler_.IsEnabled()) {
+    sampler_.Print(std::cout, GetName());
+    sampler_.Record(out_tree_->GetUserInfo(), GetName());
+  }
 
 }
 void EvalEfficiency::LoadEfficiencies() {
@@ -111,7 +243,59 @@ void EvalEfficiency::LoadEfficiencies() {
 
     auto pid = boost::lexical_cast<int>(match_results.str(1));
 
+    if (use_efficiency_model_) {
+      auto model_vector = dynamic_cast<TVectorD *>(efficiency_dir->Get("vtx_sim_y_pt_model"));
+      auto model_chi2_ndf = dynamic_cast<TParameter<Double_t> *>(efficiency_dir->Get("vtx_sim_y_pt_model_chi2ndf"));
+      if (!model_vector || !model_chi2_ndf) {
+        std::cout << obj_name << ": no efficiency model (run FitEfficiencyModel), using the binned efficiency"
+                  << std::endl;
+      } else if (!(model_chi2_ndf->GetVal() <= model_max_chi2_ndf_)) {
+        std::cout << obj_name << ": model chi2/ndf = " << model_chi2_ndf->GetVal()
+                  << " above --model-max-chi2ndf, using the binned efficiency" << std::endl;
+      } else {
+        efficiency->model = EfficiencyModel::FromVector(*model_vector);
+        if (efficiency->model.HasMask())
+          model_batches_[pid];
+        else
+          std::cout << obj_name << ": efficiency model without the fitted bins (rerun FitEfficiencyModel), "
+                    << "using the binned efficiency" << std::endl;
+      }
+    }
+
     efficiencies_.emplace(pid, efficiency);
   }
 
 }
+void EvalEfficiency::LoadSharedEfficiencies() {
+  auto checksum = SharedTables::FileStatChecksum(efficiency_src_file_name_);
+  checksum = SharedTables::StringChecksum(
+      "vtx_sim_y_pt:" + std::to_string(efficiency_eps_threshold), checksum);
+
+  shared_tables_segment_ = SharedTables::Segment::Open(shared_tables_prefix_, checksum, [this]() {
+    /* only the first process on the node reads the efficiencies */
+    LoadEfficiencies();
+    SharedTables::TableSet tables;
+    for (auto &&[pid, efficiency] : efficiencies_) {
+      auto eff_y_pt = efficiency->eff_y_pt;
+      tables.emplace_back("weight_" + std::to_string(pid),
+                          SharedTables::PackGrid(*eff_y_pt->GetTotalHistogram(), [&](int bin) {
+                            return EfficiencyWeight(*eff_y_pt, bin, efficiency_eps_threshold);
+                          }));
+    }
+    efficiencies_.clear();
+    return tables;
+  });
+  shared_tables_segment_->Print();
+
+  const std::regex re_weight_table("^weight_(-?\\d+)$");
+  std::smatch match_results;
+  for (uint32_t i_table = 0; i_table < shared_tables_segment_->GetNTables(); ++i_table) {
+    auto table_name = shared_tables_segment_->GetTableName(i_table);
+    if (!std::regex_search(table_name, match_results, re_weight_table))
+      continue;
+    auto efficiency = std::make_shared<Efficiency>();
+    efficiency->weight_grid = SharedTables::GridView(shared_tables_segment_->GetTable(i_table),
+                                                     shared_tables_segment_->GetTableSize(i_table));
+    efficiencies_.emplace(boost::lexical_cast<int>(match_results.str(1)), efficiency);
+  }
+}
@@ -7,6 +7,9 @@
 
 #include <at_task/Task.h>
 
+#include "EventSampler.hpp"
+#include "SharedTables.hpp"
+
 class EvalEfficiency : public UserFillTask {
 
  public:
@@ -25,6 +28,18 @@ class EvalEfficiency : public UserFillTask {
   std::string efficiency_field_name_;
   std::string new_branch_name_;
   double efficiency_eps_threshold{0.2};
+  bool bypass_branches_{true};
+  bool prune_input_{false};
+  bool use_efficiency_model_{false};
+  float model_min_efficiency_{0.05};
+  double model_max_chi2_ndf_{5.};
+  unsigned int sample_every_{1};
+  Long64_t sample_events_{0};
+  uint64_t sample_seed_{0};
+  std::string sample_event_id_;
+  EventSampler sampler_;
+  bool shared_tables_{false};
+  std::string shared_tables_prefix_;
 
   std::string var_centrality_name_;
   std::string var_pid_name_;
@@ -41,10 +56,35 @@ class EvalEfficiency : public UserFillTask {
   ATI2::Variable y_cm_v;
   ATI2::Variable pt_v;
   ATI2::Variable weight_v;
+  /* fields of the input particles read for the model */
+  ATI2::Variable in_pid_v;
+  ATI2::Variable in_y_cm_v;
+  ATI2::Variable in_pt_v;
 
   void LoadEfficiencies();
+  /* weights of the binned efficiencies from the shared memory of the node */
+  void LoadSharedEfficiencies();
+  void ExecModel();
   struct Efficiency;
   std::map<int, std::shared_ptr<Efficiency>> efficiencies_;
+  std::unique_ptr<SharedTables::Segment> shared_tables_segment_;
+
+  /* particles of one species in the event, buffers are reused */
+  struct ModelBatch {
+    std::vector<float> y_cm;
+    std::vector<float> pt;
+    std::vector<float> weight;
+    /* next weight to write out */
+    size_t i_next{0};
+    void Clear() {
+      y_cm.clear();
+      pt.clear();
+      i_next = 0;
+    }
+  };
+  std::map<int, ModelBatch> model_batches_;
+  /* batch of each input particle, nullptr for species without the model */
+  std::vector<ModelBatch *> particle_batches_;
 
  TASK_DEF(EvalEfficiency, 0)
 };